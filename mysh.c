@@ -11,18 +11,30 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdint.h>
 #include <limits.h>
 #include <libgen.h>
 #include <stdarg.h>
 #include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 /* ---------- FAT File System Configuration ---------- */
-#define BLOCK_SIZE 512
-#define MAX_BLOCKS 1024
+#define FAT_MAGIC 0x5441464D  // "MFAT"
+#define FAT_VERSION 6  // 2: child/sibling links in dir_entry, 3: name pool, 4: flags, 5: block checksums, 6: newline counts
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_BLOCKS 1024
+#define DEFAULT_ENTRIES 256
+#define FAT_MAX_BLOCKS 0x0FFFFFFF
+#define FAT_MAX_ENTRIES 0x00FFFFFF
 #define MAX_FILENAME 255
-#define FAT_EOC 0xFFFF  // End of chain marker
-#define FAT_FREE 0x0000 // Free block marker
+#define FAT_EOC 0xFFFFFFFF   // End of chain marker
+#define FAT_FREE 0xFFFFFFFE  // Free block marker
 
 /* ---------- Globals ---------- */
 char ROOT_PATH[PATH_MAX];
@@ -97,26 +109,224 @@ void load_history() {
 }
 
 /* ---------- FAT Data Structures ---------- */
+// On-disk layout: [superblock][fat_table][block_sums][block_lines][dir_entries][dir_names][blocks].
+// Every offset is recorded in the superblock so geometry is read at runtime.
 typedef struct {
-    char name[MAX_FILENAME + 1];
+    uint32_t magic;           // FAT_MAGIC
+    uint32_t version;         // FAT_VERSION
+    uint32_t block_size;      // Bytes per data block
+    uint32_t block_count;     // Number of data blocks
+    uint32_t max_entries;     // Capacity of the directory entry table
+    uint32_t num_entries;     // Entry slots handed out so far
+    uint32_t fat_entry_size;  // Bytes per FAT entry
+    uint32_t current_dir;     // Working directory saved with the image
+    uint64_t fat_offset;
+    uint64_t sums_offset;
+    uint64_t lines_offset;
+    uint64_t entries_offset;
+    uint64_t names_offset;
+    uint64_t blocks_offset;
+    uint64_t image_size;
+    uint64_t volume_id;       // Random per format; snapshots must carry the same one
+} fat_superblock;
+
+// Only the fields lookups and scans test live in the entry table, so two
+// entries share a cache line; names and timestamps sit in a parallel pool
+// (dir_names[i] belongs to dir_entries[i]) that is read once name_hash matches.
+typedef struct {
+    uint32_t parent_entry;  // Index of parent directory entry
+    uint32_t name_hash;     // dir_name_hash() of the entry's name
+    uint32_t first_child;   // Head of a directory's child list
+    uint32_t next_sibling;  // Next entry with the same parent
+    uint32_t first_block;
     uint32_t size;
-    uint16_t first_block;
     uint8_t is_dir;
     uint8_t is_used;
+    uint8_t flags;          // DIR_COMPRESSED
+    uint8_t reserved[5];
+} dir_entry;
+
+#define DIR_COMPRESSED 0x01  // Blocks hold a framed, compressed stream
+
+typedef struct {
+    char name[MAX_FILENAME + 1];
     time_t created;
     time_t modified;
-    uint32_t parent_entry;  // Index of parent directory entry
-} dir_entry;
+} dir_name;
 
+// In-memory view of the image; every pointer refers into one buffer
 typedef struct {
-    uint16_t fat_table[MAX_BLOCKS];  // File Allocation Table
-    dir_entry dir_entries[256];       // Directory entries (simple linear array)
-    uint8_t blocks[MAX_BLOCKS][BLOCK_SIZE];  // Data blocks
-    uint32_t num_entries;
-    uint32_t current_dir;  // Current directory entry index
+    fat_superblock *sb;
+    uint32_t *fat_table;     // File Allocation Table
+    uint32_t *block_sums;    // CRC32C of each data block as last committed
+    uint32_t *block_lines;   // Newlines in each data block as last committed
+    dir_entry *dir_entries;  // Directory entries (simple linear array)
+    dir_name *dir_names;     // Name pool, indexed like dir_entries
+    uint8_t *blocks;         // Data blocks, block_count * block_size bytes
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t current_dir;    // Current directory entry index
 } fat_fs;
 
 fat_fs *fs = NULL;
+uint8_t *fs_image = NULL;    // Whole image: malloc'd copy or shared mapping
+int fs_fd = -1;              // Open image file backing fs_image
+int fs_mapped = 0;           // fs_image is a MAP_SHARED mapping of fs_fd
+pid_t fs_owner = 0;          // Process that attached fs_image, the only one to change it
+char fs_image_path[PATH_MAX];
+
+/* ---------- Dirty Tracking ---------- */
+// One bit per DIRTY_GRAIN bytes of the image, set when that range differs
+// from what is on disk. fat_save_image() writes back only the set ranges.
+#define DIRTY_GRAIN 512
+uint64_t *dirty_map = NULL;
+uint64_t *pending_map = NULL;  // Metadata grains changed since the last commit
+uint64_t dirty_map_words = 0;
+
+/* ---------- Metadata Journal ---------- */
+// Metadata (superblock, FAT, directory entries) reaches the image only at a
+// checkpoint. Each command's metadata changes are appended to
+// mysh_fs.img.journal as one transaction under a single fsync, and
+// fat_init() replays committed transactions after a crash.
+#define JOURNAL_MAGIC 0x4C4E524A  // "JRNL"
+#define JOURNAL_CHECKPOINT_BYTES (1 << 20)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t records;
+    uint64_t seq;
+    uint64_t length;    // Bytes of records following this header
+    uint32_t crc;       // CRC32C of the header (crc = 0) and records
+    uint32_t reserved;
+} journal_header;
+
+typedef struct {
+    uint64_t offset;    // Image offset the data belongs at
+    uint32_t length;    // Bytes of data following this record
+    uint32_t reserved;
+} journal_record;
+
+int journal_fd = -1;
+uint64_t journal_seq = 0;
+
+/* ---------- Free-Space Bitmap ---------- */
+// One bit per block, set while the block is free. fat_table stays the
+// on-disk source of truth; the bitmap is rebuilt from it on load.
+// A block freed since the last commit waits in release_map instead: the
+// image on disk may still give it to a file, and data blocks are written
+// in place, so it only becomes allocatable once fat_commit() is durable.
+uint64_t *free_map = NULL;
+uint32_t free_map_words = 0;
+uint32_t free_map_hint = 0;    // Word where the next search starts (next-fit)
+uint32_t free_block_count = 0;
+uint64_t *release_map = NULL;  // Freed, but not yet by a committed FAT
+uint32_t release_count = 0;
+
+/* ---------- Block Sharing ---------- */
+// A block can be the common tail of several chains. block_shares[b] counts
+// the references to b beyond the first; like free_map it is rebuilt from
+// the FAT and the entries on load, and fat_free_chain() stops at a block
+// that is still shared. With MYSH_FS_DEDUP=1 writes look blocks up by
+// (content, next) and link to an identical one instead of allocating.
+#define DEDUP_UNLINKED 0xFFFFFFFE
+uint32_t *block_shares = NULL;
+uint64_t block_shares_total = 0;  // Sum of block_shares; 0 means nothing is shared
+int dedup_enabled = 0;
+uint32_t *dedup_buckets = NULL;
+uint32_t *dedup_next = NULL;      // Bucket chain link, DEDUP_UNLINKED if not indexed
+uint32_t *dedup_keys = NULL;      // Key each indexed block was filed under
+uint32_t dedup_mask = 0;
+
+/* ---------- Snapshots ---------- */
+// A snapshot is a copy of the entry table and name pool in a file beside
+// the image (mysh_fs.img.snap.NAME). Its files keep their chains alive
+// through block_shares, so taking one copies no data, and live writes to a
+// shared chain copy it instead of changing it in place. Each file records
+// the volume_id of its image, so one left by an earlier image is ignored.
+#define SNAPSHOT_MAGIC 0x50414E53  // "SNAP"
+#define SNAPSHOT_NAME_MAX 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_entries;
+    uint32_t current_dir;
+    uint32_t crc;        // CRC32C of the header (crc = 0), entries and names
+    int64_t created;
+    uint64_t volume_id;  // Superblock volume_id of the image it was taken from
+} snapshot_header;
+
+typedef struct {
+    char name[SNAPSHOT_NAME_MAX + 1];
+    time_t created;
+    uint32_t files;
+    uint32_t *first_blocks;  // Chains the snapshot references
+} snapshot_info;
+
+snapshot_info *snapshots = NULL;
+uint32_t snapshot_count = 0;
+
+/* ---------- Directory Lookup Index ---------- */
+// In-memory hash of live entries keyed by (parent, name). Each bucket heads
+// a chain threaded through dir_index_next, one link per entry slot.
+uint32_t *dir_index_buckets = NULL;
+uint32_t *dir_index_next = NULL;
+uint32_t dir_index_mask = 0;
+
+/* ---------- Directory Entry Slots ---------- */
+// One bit per slot below num_entries whose entry was removed. New entries
+// take the lowest dead slot before extending num_entries, and a full table
+// is relaid out at twice its size instead of failing with ENOSPC.
+uint64_t *dead_entry_map = NULL;
+uint32_t dead_entry_count = 0;
+
+/* ---------- Path Resolution Cache ---------- */
+// Bounded cache from (cwd, path) to entry index: DCACHE_SETS sets of
+// DCACHE_WAYS slots, least recently used slot evicted within a set. Only
+// successful lookups are cached; mv, rm and rmdir bump dcache_generation,
+// which invalidates every slot at once.
+#define DCACHE_SETS 64
+#define DCACHE_WAYS 4
+
+typedef struct {
+    char *path;
+    uint32_t cwd;          // (uint32_t)-1 for absolute paths
+    uint32_t entry;
+    uint64_t generation;
+    uint64_t last_used;
+} dcache_slot;
+
+dcache_slot dcache[DCACHE_SETS][DCACHE_WAYS];
+uint64_t dcache_generation = 1;
+uint64_t dcache_clock = 0;
+
+void dcache_invalidate() {
+    dcache_generation++;
+}
+
+/* ---------- Working Directory Path ---------- */
+// Path of fs->current_dir for pwd and the prompt. Rebuilt only after cd or
+// a change that can rename one of its ancestors.
+char cwd_path[PATH_MAX];
+int cwd_path_valid = 0;
+
+void cwd_invalidate() {
+    cwd_path_valid = 0;
+}
+
+/* ---------- Block Zeroing Policy ---------- */
+// Freeing a block only updates the FAT. Writers zero the unused tail of a
+// file's last block instead, so bytes past EOF always read as zero. The
+// policy (MYSH_FS_ZERO) decides what happens to the stale contents:
+//   lazy  - left in place until the block is reused (default)
+//   eager - cleared as soon as the commit that frees it is durable
+//   scrub - cleared a few blocks at a time between commands
+#define ZERO_LAZY 0
+#define ZERO_EAGER 1
+#define ZERO_SCRUB 2
+#define SCRUB_BATCH 64
+int zero_policy = ZERO_LAZY;
+uint64_t *scrub_map = NULL;    // Free blocks that may still hold old data
+uint32_t scrub_pending = 0;
 
 /* ---------- Helper: dief ---------- */
 void dief(const char *fmt, ...) {
@@ -160,503 +370,2690 @@ int path_within_root(const char *resolved) {
     return 0;
 }
 
-/* ---------- FAT File System Implementation ---------- */
+/* ---------- CRC32C ---------- */
+// The table version runs everywhere; x86-64 CPUs with SSE4.2 use the crc32
+// instruction instead, chosen once at run time.
+uint32_t crc32c_table[256];
+int crc32c_ready = 0;
+int crc32c_hw = 0;
 
-int fat_save_image(const char *filename) {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) return -1;
-    
-    size_t written = fwrite(fs, sizeof(fat_fs), 1, fp);
-    fclose(fp);
-    
-    return (written == 1) ? 0 : -1;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (uint32_t)c;
+    while (len--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
 }
+#endif
 
-int fat_load_image(const char *filename) {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) return -1;
-    
-    if (!fs) fs = malloc(sizeof(fat_fs));
-    size_t read = fread(fs, sizeof(fat_fs), 1, fp);
-    fclose(fp);
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    if (!crc32c_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+            crc32c_table[i] = c;
+        }
+#if defined(__x86_64__)
+        crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+        crc32c_ready = 1;
+    }
     
-    return (read == 1) ? 0 : -1;
+    const uint8_t *p = data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hw) return ~crc32c_sse42(crc, p, len);
+#endif
+    while (len--) crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
 }
 
-void fat_init() {
-    char imgpath[PATH_MAX];
-    snprintf(imgpath, sizeof(imgpath), "%s/mysh_fs.img", ROOT_PATH);
-    
-    // Try to load existing image
-    if (fat_load_image(imgpath) == 0) {
-        printf("Loaded existing file system from mysh_fs.img\n");
-        return;
-    }
-    
-    // Create new file system
-    printf("Creating new file system...\n");
-    fs = calloc(1, sizeof(fat_fs));
-    
-    // Initialize FAT table (all blocks free)
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        fs->fat_table[i] = FAT_FREE;
+/* ---------- FAT File System Implementation ---------- */
+
+// FNV-1a over the name; stored in each entry as name_hash
+uint32_t dir_name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ *p) * 16777619u;
     }
-    
-    // Create root directory entry
-    dir_entry *root = &fs->dir_entries[0];
-    strcpy(root->name, "/");
-    root->size = 0;
-    root->first_block = FAT_EOC;
-    root->is_dir = 1;
-    root->is_used = 1;
-    root->created = time(NULL);
-    root->modified = time(NULL);
-    root->parent_entry = 0;
-    
-    fs->num_entries = 1;
-    fs->current_dir = 0;
-    
-    // Create a sample readme.txt file
-    dir_entry *readme = &fs->dir_entries[1];
-    strcpy(readme->name, "readme.txt");
-    const char *content = "This is a virtual FAT file system.\nWelcome to mysh!\n";
-    readme->size = strlen(content);
-    readme->first_block = 0;
-    readme->is_dir = 0;
-    readme->is_used = 1;
-    readme->created = time(NULL);
-    readme->modified = time(NULL);
-    readme->parent_entry = 0;
-    
-    // Write content to first block
-    strncpy((char *)fs->blocks[0], content, BLOCK_SIZE);
-    fs->fat_table[0] = FAT_EOC;
-    
-    fs->num_entries = 2;
-    
-    // Save initial state
-    fat_save_image(imgpath);
+    return h;
 }
 
-uint16_t fat_alloc_block() {
-    for (uint16_t i = 0; i < MAX_BLOCKS; i++) {
-        if (fs->fat_table[i] == FAT_FREE) {
-            fs->fat_table[i] = FAT_EOC;
-            return i;
-        }
-    }
-    return FAT_EOC;
+// Name hash mixed with the parent index
+uint32_t dir_index_bucket(uint32_t parent, uint32_t name_hash) {
+    uint32_t h = name_hash ^ (parent * 0x9E3779B1u);
+    return (h ^ (h >> 16)) & dir_index_mask;
 }
 
-void fat_free_chain(uint16_t start_block) {
-    uint16_t current = start_block;
-    while (current != FAT_EOC && current < MAX_BLOCKS) {
-        uint16_t next = fs->fat_table[current];
-        fs->fat_table[current] = FAT_FREE;
-        memset(fs->blocks[current], 0, BLOCK_SIZE);
-        current = next;
-    }
+void dir_index_insert(uint32_t entry_idx) {
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    uint32_t b = dir_index_bucket(entry->parent_entry, entry->name_hash);
+    dir_index_next[entry_idx] = dir_index_buckets[b];
+    dir_index_buckets[b] = entry_idx;
 }
 
-uint32_t fat_find_entry(const char *name, uint32_t parent) {
-    for (uint32_t i = 0; i < fs->num_entries; i++) {
-        if (fs->dir_entries[i].is_used && 
-            fs->dir_entries[i].parent_entry == parent &&
-            strcmp(fs->dir_entries[i].name, name) == 0) {
-            return i;
+// Must run before the entry's parent or name changes
+void dir_index_remove(uint32_t entry_idx) {
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    uint32_t *link = &dir_index_buckets[dir_index_bucket(entry->parent_entry, entry->name_hash)];
+    while (*link != (uint32_t)-1) {
+        if (*link == entry_idx) {
+            *link = dir_index_next[entry_idx];
+            return;
         }
+        link = &dir_index_next[*link];
     }
-    return (uint32_t)-1;
 }
 
-uint32_t fat_resolve_path(const char *path) {
-    if (!path || path[0] == '\0') return fs->current_dir;
-    if (strcmp(path, "/") == 0) return 0;
-    
-    uint32_t current = (path[0] == '/') ? 0 : fs->current_dir;
-    char *copy = strdup(path);
-    char *tok = strtok(copy, "/");
-    
-    while (tok) {
-        if (strcmp(tok, ".") == 0) {
-            tok = strtok(NULL, "/");
-            continue;
-        }
-        if (strcmp(tok, "..") == 0) {
-            current = fs->dir_entries[current].parent_entry;
-            tok = strtok(NULL, "/");
-            continue;
-        }
-        
-        uint32_t next = fat_find_entry(tok, current);
-        if (next == (uint32_t)-1) {
-            free(copy);
-            return (uint32_t)-1;
+void dir_index_rebuild() {
+    uint32_t buckets = 64;
+    while (buckets < fs->sb->max_entries * 2) buckets *= 2;
+    dir_index_mask = buckets - 1;
+    
+    free(dir_index_buckets);
+    free(dir_index_next);
+    dir_index_buckets = malloc(buckets * sizeof(uint32_t));
+    dir_index_next = malloc(fs->sb->max_entries * sizeof(uint32_t));
+    memset(dir_index_buckets, 0xFF, buckets * sizeof(uint32_t));
+    
+    for (uint32_t i = 0; i < fs->sb->num_entries; i++) {
+        if (fs->dir_entries[i].is_used) dir_index_insert(i);
+    }
+}
+
+void dir_slots_rebuild() {
+    free(dead_entry_map);
+    dead_entry_map = calloc((fs->sb->max_entries + 63) / 64, sizeof(uint64_t));
+    dead_entry_count = 0;
+    for (uint32_t i = 0; i < fs->sb->num_entries; i++) {
+        if (!fs->dir_entries[i].is_used) {
+            dead_entry_map[i / 64] |= 1ULL << (i % 64);
+            dead_entry_count++;
         }
-        current = next;
-        tok = strtok(NULL, "/");
     }
-    
-    free(copy);
-    return current;
 }
 
-int fat_mkdir(const char *path) {
-    if (!path) return -1;
-    
-    char *copy = strdup(path);
-    char *last = strrchr(copy, '/');
-    char *name;
-    uint32_t parent;
-    
-    if (!last) {
-        parent = fs->current_dir;
-        name = copy;
-    } else {
-        *last = '\0';
-        parent = fat_resolve_path(copy);
-        name = last + 1;
-        if (parent == (uint32_t)-1) {
-            free(copy);
-            return -1;
+void fat_rebuild_shares();
+
+void fat_rebuild_free_map() {
+    free_map_words = (fs->block_count + 63) / 64;
+    free(free_map);
+    free_map = calloc(free_map_words, sizeof(uint64_t));
+    if (!release_map) release_map = calloc(free_map_words, sizeof(uint64_t));
+    for (uint32_t i = 0; i < fs->block_count; i++) {
+        if (fs->fat_table[i] == FAT_FREE && !(release_map[i / 64] & (1ULL << (i % 64)))) {
+            free_map[i / 64] |= 1ULL << (i % 64);
         }
     }
     
-    // Check if already exists
-    if (fat_find_entry(name, parent) != (uint32_t)-1) {
-        free(copy);
-        errno = EEXIST;
-        return -1;
+    free_block_count = 0;
+    for (uint32_t w = 0; w < free_map_words; w++) {
+        free_block_count += __builtin_popcountll(free_map[w]);
     }
-    
-    // Check if we have space for more entries
-    if (fs->num_entries >= 256) {
-        free(copy);
-        errno = ENOSPC;
-        return -1;
+    free_map_hint = 0;
+    
+    // Nothing records which free blocks were scrubbed, so recheck them all
+    free(scrub_map);
+    scrub_map = NULL;
+    scrub_pending = 0;
+    if (zero_policy == ZERO_SCRUB) {
+        scrub_map = malloc(free_map_words * sizeof(uint64_t));
+        memcpy(scrub_map, free_map, free_map_words * sizeof(uint64_t));
+        scrub_pending = free_block_count;
     }
     
-    // Create new directory entry
-    dir_entry *new_dir = &fs->dir_entries[fs->num_entries];
-    strncpy(new_dir->name, name, MAX_FILENAME);
-    new_dir->size = 0;
-    new_dir->first_block = FAT_EOC;
-    new_dir->is_dir = 1;
-    new_dir->is_used = 1;
-    new_dir->created = time(NULL);
-    new_dir->modified = time(NULL);
-    new_dir->parent_entry = parent;
-    
-    fs->num_entries++;
-    free(copy);
+    fat_rebuild_shares();
+}
+
+int pread_full(int fd, void *buf, size_t len, off_t offset) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        offset += n;
+        len -= n;
+    }
     return 0;
 }
 
-int fat_touch(const char *path) {
-    if (!path) return -1;
-    
-    char *copy = strdup(path);
-    char *last = strrchr(copy, '/');
-    char *name;
-    uint32_t parent;
-    
-    if (!last) {
-        parent = fs->current_dir;
-        name = copy;
+// The image is mapped unless MYSH_FS_MMAP=0 asks for the buffered fallback
+int fat_mmap_enabled() {
+    const char *value = getenv("MYSH_FS_MMAP");
+    return !(value && strcmp(value, "0") == 0);
+}
+
+// Data blocks are mapped shared; the metadata in front of them is mapped
+// private so it cannot reach the file before its journal transaction does.
+// That split is only sound with one writer: a forked child sees the parent's
+// data blocks change under it and keeps metadata the parent never sees, so
+// only the process that attached the image (fs_owner) may change it.
+uint8_t *fat_map_image(int fd, const fat_superblock *sb) {
+    if (!fat_mmap_enabled()) return NULL;
+    if (sb->blocks_offset % sysconf(_SC_PAGESIZE) != 0) return NULL;
+    
+    void *image = mmap(NULL, sb->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) return NULL;
+    if (mmap(image, sb->blocks_offset, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(image, sb->image_size);
+        return NULL;
+    }
+    return image;
+}
+
+void fat_detach_image() {
+    if (!fs_image) return;
+    if (fs_mapped) {
+        munmap(fs_image, fs->sb->image_size);
     } else {
-        *last = '\0';
-        parent = fat_resolve_path(copy);
-        name = last + 1;
-        if (parent == (uint32_t)-1) {
-            free(copy);
-            return -1;
-        }
+        free(fs_image);
     }
-    
-    // Check if already exists
-    uint32_t existing = fat_find_entry(name, parent);
-    if (existing != (uint32_t)-1) {
-        if (fs->dir_entries[existing].is_dir) {
-            free(copy);
-            errno = EISDIR;
-            return -1;
+    if (fs_fd >= 0) close(fs_fd);
+    if (journal_fd >= 0) close(journal_fd);
+    fs_image = NULL;
+    fs_fd = -1;
+    journal_fd = -1;
+    fs_mapped = 0;
+}
+
+// Point fs at the regions of an image described by its superblock. fd stays
+// open for write-back whether the image is mapped or a malloc'd copy.
+void fat_attach_image(uint8_t *image, const char *filename, int fd, int mapped) {
+    if (!fs) fs = calloc(1, sizeof(fat_fs));
+    fat_detach_image();
+    fs_image = image;
+    fs_fd = fd;
+    fs_mapped = mapped;
+    fs_owner = getpid();
+    snprintf(fs_image_path, sizeof(fs_image_path), "%s", filename);
+    free(release_map);  // Frees of another image are settled or void
+    release_map = NULL;
+    release_count = 0;
+    
+    fs->sb = (fat_superblock *)image;
+    fs->fat_table = (uint32_t *)(image + fs->sb->fat_offset);
+    fs->block_sums = (uint32_t *)(image + fs->sb->sums_offset);
+    fs->block_lines = (uint32_t *)(image + fs->sb->lines_offset);
+    fs->dir_entries = (dir_entry *)(image + fs->sb->entries_offset);
+    fs->dir_names = (dir_name *)(image + fs->sb->names_offset);
+    fs->blocks = image + fs->sb->blocks_offset;
+    fs->block_size = fs->sb->block_size;
+    fs->block_count = fs->sb->block_count;
+    fs->current_dir = fs->sb->current_dir;
+    cwd_invalidate();
+    fat_rebuild_free_map();
+    dir_index_rebuild();
+    dir_slots_rebuild();
+    dcache_invalidate();
+    
+    uint64_t grains = (fs->sb->image_size + DIRTY_GRAIN - 1) / DIRTY_GRAIN;
+    dirty_map_words = (grains + 63) / 64;
+    free(dirty_map);
+    free(pending_map);
+    dirty_map = calloc(dirty_map_words, sizeof(uint64_t));
+    pending_map = calloc(dirty_map_words, sizeof(uint64_t));
+}
+
+void fat_mark_dirty(const void *ptr, size_t len) {
+    if (len == 0) return;
+    uint64_t start = ((const uint8_t *)ptr - fs_image) / DIRTY_GRAIN;
+    uint64_t end = ((const uint8_t *)ptr - fs_image + len - 1) / DIRTY_GRAIN;
+    for (uint64_t g = start; g <= end; g++) {
+        dirty_map[g / 64] |= 1ULL << (g % 64);
+        if (g * DIRTY_GRAIN < fs->sb->blocks_offset) {
+            pending_map[g / 64] |= 1ULL << (g % 64);
         }
-        // Update modification time
-        fs->dir_entries[existing].modified = time(NULL);
-        free(copy);
-        return 0;
     }
-    
-    // Check if we have space
-    if (fs->num_entries >= 256) {
-        free(copy);
-        errno = ENOSPC;
-        return -1;
+}
+
+// Find the next run of set bits in map between grains *start and limit
+int fat_next_run(const uint64_t *map, uint64_t *start, uint64_t *end, uint64_t limit) {
+    uint64_t g = *start;
+    while (g < limit) {
+        uint64_t word = map[g / 64] >> (g % 64);
+        if (word == 0) {
+            g = (g / 64 + 1) * 64;
+            continue;
+        }
+        g += __builtin_ctzll(word);
+        if (g >= limit) break;
+        
+        uint64_t run = g;
+        while (run < limit && (map[run / 64] & (1ULL << (run % 64)))) run++;
+        *start = g;
+        *end = run;
+        return 1;
     }
-    
-    // Create new file entry
-    dir_entry *new_file = &fs->dir_entries[fs->num_entries];
-    strncpy(new_file->name, name, MAX_FILENAME);
-    new_file->size = 0;
-    new_file->first_block = FAT_EOC;
-    new_file->is_dir = 0;
-    new_file->is_used = 1;
-    new_file->created = time(NULL);
-    new_file->modified = time(NULL);
-    new_file->parent_entry = parent;
-    
-    fs->num_entries++;
-    
-    // DON'T create empty real file here anymore
-    // Let the editor create it naturally
-    
-    free(copy);
     return 0;
 }
 
-int fat_write_file(uint32_t entry_idx, const char *data, size_t size) {
-    if (entry_idx >= fs->num_entries || !fs->dir_entries[entry_idx].is_used) {
-        return -1;
-    }
-    
-    dir_entry *entry = &fs->dir_entries[entry_idx];
-    if (entry->is_dir) return -1;
-    
-    // Free existing blocks
-    if (entry->first_block != FAT_EOC) {
-        fat_free_chain(entry->first_block);
-    }
-    
-    if (size == 0) {
-        entry->first_block = FAT_EOC;
-        entry->size = 0;
-        entry->modified = time(NULL);
-        return 0;
+void fat_clear_run(uint64_t *map, uint64_t start, uint64_t end) {
+    for (uint64_t g = start; g < end; g++) {
+        map[g / 64] &= ~(1ULL << (g % 64));
     }
-    
-    // Allocate blocks for new data
-    size_t blocks_needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint16_t first = FAT_EOC, prev = FAT_EOC;
-    
-    for (size_t i = 0; i < blocks_needed; i++) {
-        uint16_t block = fat_alloc_block();
-        if (block == FAT_EOC) {
-            // Out of space, free what we allocated
-            if (first != FAT_EOC) fat_free_chain(first);
-            return -1;
+}
+
+void fat_mark_entry(uint32_t entry_idx) {
+    fat_mark_dirty(&fs->dir_entries[entry_idx], sizeof(dir_entry));
+}
+
+// Name an entry; the caller takes it out of the lookup index first
+void dir_set_name(uint32_t entry_idx, const char *name) {
+    dir_name *slot = &fs->dir_names[entry_idx];
+    strncpy(slot->name, name, MAX_FILENAME);
+    slot->name[MAX_FILENAME] = '\0';
+    fs->dir_entries[entry_idx].name_hash = dir_name_hash(slot->name);
+    fat_mark_dirty(slot, sizeof(dir_name));
+    fat_mark_entry(entry_idx);
+}
+
+void dir_set_modified(uint32_t entry_idx) {
+    fs->dir_names[entry_idx].modified = time(NULL);
+    fat_mark_dirty(&fs->dir_names[entry_idx].modified, sizeof(time_t));
+}
+
+uint8_t *fat_block(uint32_t block) {
+    return fs->blocks + (size_t)block * fs->block_size;
+}
+
+void fat_mark_block(uint32_t block) {
+    fat_mark_dirty(fat_block(block), fs->block_size);
+}
+
+void fat_set_next(uint32_t block, uint32_t next) {
+    fs->fat_table[block] = next;
+    fat_mark_dirty(&fs->fat_table[block], sizeof(uint32_t));
+}
+
+// ".new" is left to the temporary file a snapshot is written through
+int snapshot_valid_name(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > SNAPSHOT_NAME_MAX || name[0] == '.') return 0;
+    if (len >= 4 && strcmp(name + len - 4, ".new") == 0) return 0;
+    for (const char *p = name; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '.' && *p != '_' && *p != '-') return 0;
+    }
+    return 1;
+}
+
+void snapshot_path(char *buf, size_t len, const char *name) {
+    snprintf(buf, len, "%s.snap.%s", fs_image_path, name);
+}
+
+// Read and verify a snapshot file: header, then entries, then names
+uint8_t *snapshot_read(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    
+    struct stat st;
+    uint8_t *buf = NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snapshot_header) ||
+        !(buf = malloc(st.st_size)) || pread_full(fd, buf, st.st_size, 0) < 0) {
+        free(buf);
+        close(fd);
+        errno = EIO;
+        return NULL;
+    }
+    close(fd);
+    
+    snapshot_header *hdr = (snapshot_header *)buf;
+    uint32_t crc = hdr->crc;
+    hdr->crc = 0;
+    if (hdr->magic != SNAPSHOT_MAGIC || hdr->current_dir >= hdr->num_entries ||
+        (uint64_t)st.st_size != sizeof(*hdr) + (uint64_t)hdr->num_entries * (sizeof(dir_entry) + sizeof(dir_name)) ||
+        crc32c(0, buf, st.st_size) != crc) {
+        free(buf);
+        errno = EINVAL;
+        return NULL;
+    }
+    hdr->crc = crc;
+    if (hdr->volume_id != fs->sb->volume_id) {
+        free(buf);
+        errno = ESTALE;
+        return NULL;
+    }
+    return buf;
+}
+
+// Record a snapshot read from buf in the snapshots list. Returns NULL with
+// the list unchanged if there is no memory for it.
+snapshot_info *snapshot_add(const char *name, const uint8_t *buf) {
+    const snapshot_header *hdr = (const snapshot_header *)buf;
+    const dir_entry *entries = (const dir_entry *)(buf + sizeof(*hdr));
+    
+    uint32_t *first_blocks = malloc((hdr->num_entries + 1) * sizeof(uint32_t));
+    snapshot_info *list = first_blocks ? realloc(snapshots, (snapshot_count + 1) * sizeof(snapshot_info)) : NULL;
+    if (!list) {
+        free(first_blocks);
+        errno = ENOMEM;
+        return NULL;
+    }
+    snapshots = list;
+    snapshot_info *info = &snapshots[snapshot_count++];
+    snprintf(info->name, sizeof(info->name), "%s", name);
+    info->created = hdr->created;
+    info->files = 0;
+    info->first_blocks = first_blocks;
+    for (uint32_t i = 0; i < hdr->num_entries; i++) {
+        if (entries[i].is_used && !entries[i].is_dir && entries[i].first_block < fs->block_count) {
+            info->first_blocks[info->files++] = entries[i].first_block;
+        }
+    }
+    return info;
+}
+
+int snapshot_cmp(const void *a, const void *b) {
+    const snapshot_info *x = a, *y = b;
+    if (x->created != y->created) return (x->created < y->created) ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// Open the directory holding the snapshots of image; prefix gets the
+// "<image name>.snap." that starts their file names
+DIR *snapshots_open(const char *image, char *prefix, size_t len) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", image);
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    snprintf(prefix, len, "%s.snap.", slash ? slash + 1 : dir);
+    return opendir(slash ? (dir[0] ? dir : "/") : ".");
+}
+
+// Delete whatever snapshot files a previous image left beside image
+void snapshots_purge(const char *image) {
+    char prefix[PATH_MAX + 8];
+    DIR *d = snapshots_open(image, prefix, sizeof(prefix));
+    if (!d) return;
+    size_t prefix_len = strlen(prefix);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, prefix, prefix_len) != 0) continue;
+        char path[PATH_MAX + 264];
+        snprintf(path, sizeof(path), "%s.snap.%s", image, de->d_name + prefix_len);
+        unlink(path);
+    }
+    closedir(d);
+}
+
+// Load the list of snapshots kept beside the current image
+void snapshots_scan() {
+    for (uint32_t i = 0; i < snapshot_count; i++) free(snapshots[i].first_blocks);
+    free(snapshots);
+    snapshots = NULL;
+    snapshot_count = 0;
+    
+    char prefix[PATH_MAX + 8];
+    DIR *d = snapshots_open(fs_image_path, prefix, sizeof(prefix));
+    if (!d) return;
+    size_t prefix_len = strlen(prefix);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        // Also passes over the .new file of a snapshot being written
+        const char *name = de->d_name + prefix_len;
+        if (strncmp(de->d_name, prefix, prefix_len) != 0 || !snapshot_valid_name(name)) {
+            continue;
         }
         
-        size_t offset = i * BLOCK_SIZE;
-        size_t to_copy = (size - offset > BLOCK_SIZE) ? BLOCK_SIZE : (size - offset);
-        memcpy(fs->blocks[block], data + offset, to_copy);
-        
-        if (first == FAT_EOC) {
-            first = block;
-        } else {
-            fs->fat_table[prev] = block;
+        char path[PATH_MAX + 80];
+        snapshot_path(path, sizeof(path), name);
+        uint8_t *buf = snapshot_read(path);
+        if (!buf) {
+            fprintf(stderr, "mysh: snapshot '%s' %s and was ignored\n", name,
+                    errno == ESTALE ? "belongs to another image" : "is unreadable");
+            continue;
         }
-        prev = block;
+        // Its blocks are not held, so say so rather than crash
+        if (!snapshot_add(name, buf)) {
+            fprintf(stderr, "mysh: snapshot '%s' could not be loaded: %s\n", name, strerror(errno));
+        }
+        free(buf);
     }
-    
-    entry->first_block = first;
-    entry->size = size;
-    entry->modified = time(NULL);
-    return 0;
+    closedir(d);
+    if (snapshot_count > 1) qsort(snapshots, snapshot_count, sizeof(snapshot_info), snapshot_cmp);
 }
 
-char* fat_read_file(uint32_t entry_idx) {
-    if (entry_idx >= fs->num_entries || !fs->dir_entries[entry_idx].is_used) {
-        return NULL;
+uint32_t dedup_key(const uint8_t *content, uint32_t next) {
+    return crc32c(next, content, fs->block_size);
+}
+
+void dedup_insert(uint32_t block) {
+    uint32_t key = dedup_key(fat_block(block), fs->fat_table[block]);
+    dedup_keys[block] = key;
+    dedup_next[block] = dedup_buckets[key & dedup_mask];
+    dedup_buckets[key & dedup_mask] = block;
+}
+
+void dedup_remove(uint32_t block) {
+    if (dedup_next[block] == DEDUP_UNLINKED) return;
+    uint32_t *link = &dedup_buckets[dedup_keys[block] & dedup_mask];
+    while (*link != (uint32_t)-1) {
+        if (*link == block) {
+            *link = dedup_next[block];
+            break;
+        }
+        link = &dedup_next[*link];
+    }
+    dedup_next[block] = DEDUP_UNLINKED;
+}
+
+// An allocated block holding content and linking to next. Keys go stale when
+// a block is later patched in place, so every candidate is compared in full.
+uint32_t dedup_find(const uint8_t *content, uint32_t next) {
+    uint32_t key = dedup_key(content, next);
+    for (uint32_t b = dedup_buckets[key & dedup_mask]; b != (uint32_t)-1; b = dedup_next[b]) {
+        if (dedup_keys[b] == key && fs->fat_table[b] == next &&
+            memcmp(fat_block(b), content, fs->block_size) == 0) {
+            return b;
+        }
+    }
+    return FAT_EOC;
+}
+
+// Count every link to each block (from entries, snapshots and the FAT),
+// keeping those beyond the first, then index all allocated blocks for dedup
+void fat_rebuild_shares() {
+    free(block_shares);
+    block_shares = calloc(fs->block_count, sizeof(uint32_t));
+    for (uint32_t i = 0; i < fs->sb->num_entries; i++) {
+        dir_entry *entry = &fs->dir_entries[i];
+        if (entry->is_used && !entry->is_dir && entry->first_block < fs->block_count) {
+            block_shares[entry->first_block]++;
+        }
+    }
+    snapshots_scan();
+    for (uint32_t s = 0; s < snapshot_count; s++) {
+        for (uint32_t f = 0; f < snapshots[s].files; f++) block_shares[snapshots[s].first_blocks[f]]++;
+    }
+    for (uint32_t b = 0; b < fs->block_count; b++) {
+        if (fs->fat_table[b] < fs->block_count) block_shares[fs->fat_table[b]]++;
+    }
+    block_shares_total = 0;
+    for (uint32_t b = 0; b < fs->block_count; b++) {
+        if (block_shares[b] > 0) block_shares[b]--;
+        block_shares_total += block_shares[b];
     }
     
+    free(dedup_buckets);
+    free(dedup_next);
+    free(dedup_keys);
+    dedup_buckets = dedup_next = dedup_keys = NULL;
+    if (!dedup_enabled) return;
+    
+    uint32_t buckets = 64;
+    while (buckets < fs->block_count) buckets *= 2;
+    dedup_mask = buckets - 1;
+    dedup_buckets = malloc(buckets * sizeof(uint32_t));
+    dedup_next = malloc(fs->block_count * sizeof(uint32_t));
+    dedup_keys = malloc(fs->block_count * sizeof(uint32_t));
+    memset(dedup_buckets, 0xFF, buckets * sizeof(uint32_t));
+    for (uint32_t b = 0; b < fs->block_count; b++) {
+        dedup_next[b] = DEDUP_UNLINKED;
+        if (fs->fat_table[b] != FAT_FREE) dedup_insert(b);
+    }
+}
+
+// Append an entry to its parent's child list, keeping creation order
+void dir_link_child(uint32_t entry_idx) {
     dir_entry *entry = &fs->dir_entries[entry_idx];
-    if (entry->is_dir) return NULL;
-    if (entry->size == 0) return strdup("");
-    
-    char *data = malloc(entry->size + 1);
-    size_t offset = 0;
-    uint16_t current = entry->first_block;
-    
-    while (current != FAT_EOC && offset < entry->size) {
-        size_t to_copy = (entry->size - offset > BLOCK_SIZE) ? BLOCK_SIZE : (entry->size - offset);
-        memcpy(data + offset, fs->blocks[current], to_copy);
-        offset += to_copy;
-        current = fs->fat_table[current];
+    uint32_t parent = entry->parent_entry;
+    entry->next_sibling = (uint32_t)-1;
+    fat_mark_entry(entry_idx);
+    if (entry_idx == parent) return;  // The root is not its own child
+    
+    uint32_t *link = &fs->dir_entries[parent].first_child;
+    uint32_t owner = parent;
+    while (*link != (uint32_t)-1) {
+        owner = *link;
+        link = &fs->dir_entries[owner].next_sibling;
     }
-    
-    data[entry->size] = '\0';
-    return data;
+    *link = entry_idx;
+    fat_mark_entry(owner);
 }
 
-void fat_ls(const char *path) {
-    uint32_t dir_idx = path ? fat_resolve_path(path) : fs->current_dir;
-    
-    if (dir_idx == (uint32_t)-1) {
-        fprintf(stderr, "ls: no such directory: %s\n", path ? path : "");
-        return;
+// Must run before the entry's parent_entry changes
+void dir_unlink_child(uint32_t entry_idx) {
+    uint32_t parent = fs->dir_entries[entry_idx].parent_entry;
+    uint32_t *link = &fs->dir_entries[parent].first_child;
+    uint32_t owner = parent;
+    while (*link != (uint32_t)-1) {
+        if (*link == entry_idx) {
+            *link = fs->dir_entries[entry_idx].next_sibling;
+            fat_mark_entry(owner);
+            return;
+        }
+        owner = *link;
+        link = &fs->dir_entries[owner].next_sibling;
     }
-    
-    if (!fs->dir_entries[dir_idx].is_dir) {
-        printf("%s\n", fs->dir_entries[dir_idx].name);
-        fflush(stdout);
-        return;
+}
+
+// Rebuild every child list from parent_entry (used when importing)
+void dir_links_rebuild() {
+    uint32_t n = fs->sb->num_entries;
+    uint32_t *last = malloc(n * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) {
+        fs->dir_entries[i].first_child = (uint32_t)-1;
+        fs->dir_entries[i].next_sibling = (uint32_t)-1;
+        last[i] = (uint32_t)-1;
     }
     
-    // List all entries in this directory - one per line
-    for (uint32_t i = 0; i < fs->num_entries; i++) {
-        if (fs->dir_entries[i].is_used && 
-            fs->dir_entries[i].parent_entry == dir_idx) {
-            printf("%s%s\n", 
-                   fs->dir_entries[i].name,
-                   fs->dir_entries[i].is_dir ? "/" : "");
-            fflush(stdout);  // Flush after each line
+    for (uint32_t i = 1; i < n; i++) {
+        dir_entry *entry = &fs->dir_entries[i];
+        if (!entry->is_used || entry->parent_entry >= n || entry->parent_entry == i) continue;
+        uint32_t p = entry->parent_entry;
+        if (last[p] == (uint32_t)-1) {
+            fs->dir_entries[p].first_child = i;
+        } else {
+            fs->dir_entries[last[p]].next_sibling = i;
         }
+        last[p] = i;
     }
+    free(last);
+    fat_mark_dirty(fs->dir_entries, n * sizeof(dir_entry));
 }
 
-void fat_cat(const char *path) {
-    uint32_t entry_idx = fat_resolve_path(path);
+uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) / align * align;
+}
+
+// Fill in the region offsets of a superblock from its geometry
+void fat_compute_layout(fat_superblock *sb) {
+    sb->fat_entry_size = sizeof(uint32_t);
+    sb->fat_offset = align_up(sizeof(fat_superblock), 64);
+    sb->sums_offset = align_up(sb->fat_offset + (uint64_t)sb->block_count * sb->fat_entry_size, 64);
+    sb->lines_offset = align_up(sb->sums_offset + (uint64_t)sb->block_count * sizeof(uint32_t), 64);
+    sb->entries_offset = align_up(sb->lines_offset + (uint64_t)sb->block_count * sizeof(uint32_t), 64);
+    
+    // Keep data blocks page aligned so they can be mapped directly
+    uint64_t align = sb->block_size > 4096 ? sb->block_size : 4096;
+    sb->names_offset = align_up(sb->entries_offset + (uint64_t)sb->max_entries * sizeof(dir_entry), 64);
+    sb->blocks_offset = align_up(sb->names_offset + (uint64_t)sb->max_entries * sizeof(dir_name), align);
+    sb->image_size = sb->blocks_offset + (uint64_t)sb->block_count * sb->block_size;
+}
+
+int fat_valid_geometry(uint32_t block_size, uint32_t block_count, uint32_t max_entries) {
+    if (block_size < 512 || block_size > 65536 || (block_size & (block_size - 1))) return 0;
+    if (block_count < 16 || block_count > FAT_MAX_BLOCKS) return 0;
+    if (max_entries < 16 || max_entries > FAT_MAX_ENTRIES) return 0;
+    return 1;
+}
+
+// Create filename as an empty file system (root directory only) with the
+// given geometry. The file is sized sparsely, so untouched blocks cost nothing.
+int fat_format(const char *filename, uint32_t block_size, uint32_t block_count, uint32_t max_entries) {
+    if (!fat_valid_geometry(block_size, block_count, max_entries)) {
+        errno = EINVAL;
+        return -1;
+    }
     
-    if (entry_idx == (uint32_t)-1) {
-        fprintf(stderr, "cat: no such file: %s\n", path ? path : "");
-        return;
+    fat_superblock sb = {0};
+    sb.magic = FAT_MAGIC;
+    sb.version = FAT_VERSION;
+    sb.block_size = block_size;
+    sb.block_count = block_count;
+    sb.max_entries = max_entries;
+    fat_compute_layout(&sb);
+    int rfd = open("/dev/urandom", O_RDONLY);
+    if (rfd < 0 || read(rfd, &sb.volume_id, sizeof(sb.volume_id)) != sizeof(sb.volume_id)) {
+        sb.volume_id = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid();
     }
+    if (rfd >= 0) close(rfd);
     
-    if (fs->dir_entries[entry_idx].is_dir) {
-        fprintf(stderr, "cat: is a directory: %s\n", path);
-        return;
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, sb.image_size) < 0) {
+        close(fd);
+        unlink(filename);
+        return -1;
+    }
+    
+    uint8_t *image = fat_map_image(fd, &sb);
+    int mapped = (image != NULL);
+    if (!mapped) {
+        image = calloc(1, sb.image_size);
+        if (!image) {
+            close(fd);
+            unlink(filename);
+            return -1;
+        }
     }
+    memcpy(image, &sb, sizeof(sb));
     
-    char *content = fat_read_file(entry_idx);
-    if (content) {
-        printf("%s", content);
-        free(content);
+    // Initialize FAT table (all blocks free)
+    uint32_t *fat_table = (uint32_t *)(image + sb.fat_offset);
+    for (uint32_t i = 0; i < block_count; i++) {
+        fat_table[i] = FAT_FREE;
     }
+    
+    // Create root directory entry
+    dir_entry *root = (dir_entry *)(image + sb.entries_offset);
+    dir_name *root_name = (dir_name *)(image + sb.names_offset);
+    strcpy(root_name->name, "/");
+    root_name->created = time(NULL);
+    root_name->modified = time(NULL);
+    root->name_hash = dir_name_hash("/");
+    root->size = 0;
+    root->first_block = FAT_EOC;
+    root->is_dir = 1;
+    root->is_used = 1;
+    root->parent_entry = 0;
+    root->first_child = (uint32_t)-1;
+    root->next_sibling = (uint32_t)-1;
+    ((fat_superblock *)image)->num_entries = 1;
+    
+    // Snapshots of an earlier image by this name would not match this one
+    snapshots_purge(filename);
+    fat_attach_image(image, filename, fd, mapped);
+    fat_mark_dirty(fs_image, sb.entries_offset + sizeof(dir_entry));
+    fat_mark_dirty(root_name, sizeof(dir_name));
+    return 0;
 }
 
-int fat_cd(const char *path) {
-    if (!path) {
-        fs->current_dir = 0;
+int pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write back each run of dirty grains in the byte range [from, to): msync of
+// the covering pages for mapped data blocks, pwrite for everything else
+int fat_flush_dirty(uint64_t from, uint64_t to, int *wrote) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t g = from / DIRTY_GRAIN, run;
+    uint64_t limit = (to + DIRTY_GRAIN - 1) / DIRTY_GRAIN;
+    
+    while (fat_next_run(dirty_map, &g, &run, limit)) {
+        uint64_t start = g * DIRTY_GRAIN;
+        uint64_t end = run * DIRTY_GRAIN;
+        if (end > fs->sb->image_size) end = fs->sb->image_size;
+        
+        int rc;
+        if (fs_mapped && start >= fs->sb->blocks_offset) {
+            uint64_t pstart = start / page * page;
+            rc = msync(fs_image + pstart, end - pstart, MS_SYNC);
+        } else {
+            rc = pwrite_full(fs_fd, fs_image + start, end - start, start);
+        }
+        if (rc < 0) return -1;
+        
+        fat_clear_run(dirty_map, g, run);
+        fat_clear_run(pending_map, g, run);
+        if (wrote) *wrote = 1;
+        g = run;
+    }
+    return 0;
+}
+
+uint32_t count_newlines(const void *data, size_t len) {
+    const char *p = data, *end = p + len;
+    uint32_t count = 0;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+// Recompute the checksum and newline count of every data block with a
+// dirty grain. Both are metadata, so they reach the image through the same
+// transaction as the FAT links that describe the blocks.
+void fat_update_sums() {
+    uint64_t g = fs->sb->blocks_offset / DIRTY_GRAIN, run;
+    uint64_t limit = (fs->sb->image_size + DIRTY_GRAIN - 1) / DIRTY_GRAIN;
+    while (fat_next_run(dirty_map, &g, &run, limit)) {
+        uint32_t first = (g * DIRTY_GRAIN - fs->sb->blocks_offset) / fs->block_size;
+        uint32_t last = (run * DIRTY_GRAIN - fs->sb->blocks_offset + fs->block_size - 1) / fs->block_size;
+        if (last > fs->block_count) last = fs->block_count;
+        for (uint32_t b = first; b < last; b++) {
+            uint32_t sum = crc32c(0, fat_block(b), fs->block_size);
+            if (fs->block_sums[b] != sum) {
+                fs->block_sums[b] = sum;
+                fat_mark_dirty(&fs->block_sums[b], sizeof(uint32_t));
+            }
+            uint32_t lines = count_newlines(fat_block(b), fs->block_size);
+            if (fs->block_lines[b] != lines) {
+                fs->block_lines[b] = lines;
+                fat_mark_dirty(&fs->block_lines[b], sizeof(uint32_t));
+            }
+        }
+        g = run;
+    }
+}
+
+int fat_checkpoint();
+void fat_release_freed();
+
+// Append metadata changed since the last commit to the journal as a single
+// transaction. Data blocks are written first so a replayed entry never
+// points at blocks that did not make it to disk.
+int fat_commit() {
+    if (!fs_image) return 0;
+    if (getpid() != fs_owner) {
+        errno = EPERM;  // A forked child: its metadata is not the image's
+        return -1;
+    }
+    fat_update_sums();
+    
+    int wrote = 0;
+    if (fat_flush_dirty(fs->sb->blocks_offset, fs->sb->image_size, &wrote) < 0) return -1;
+    if (wrote && !fs_mapped && fdatasync(fs_fd) < 0) return -1;
+    
+    uint64_t limit = fs->sb->blocks_offset / DIRTY_GRAIN;
+    uint64_t g = 0, run;
+    size_t length = 0;
+    uint32_t records = 0;
+    while (fat_next_run(pending_map, &g, &run, limit)) {
+        length += sizeof(journal_record) + (run - g) * DIRTY_GRAIN;
+        records++;
+        g = run;
+    }
+    if (records == 0) {
+        fat_release_freed();
         return 0;
     }
     
-    uint32_t dir_idx = fat_resolve_path(path);
-    if (dir_idx == (uint32_t)-1) {
-        errno = ENOENT;
-        return -1;
+    uint8_t *txn = malloc(sizeof(journal_header) + length);
+    if (!txn) return -1;
+    journal_header *hdr = (journal_header *)txn;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->records = records;
+    hdr->seq = ++journal_seq;
+    hdr->length = length;
+    
+    uint8_t *p = txn + sizeof(journal_header);
+    g = 0;
+    while (fat_next_run(pending_map, &g, &run, limit)) {
+        journal_record rec = {0};
+        rec.offset = g * DIRTY_GRAIN;
+        rec.length = (run - g) * DIRTY_GRAIN;
+        memcpy(p, &rec, sizeof(rec));
+        memcpy(p + sizeof(rec), fs_image + rec.offset, rec.length);
+        p += sizeof(rec) + rec.length;
+        g = run;
     }
+    hdr->crc = crc32c(0, txn, sizeof(journal_header) + length);
     
-    if (!fs->dir_entries[dir_idx].is_dir) {
-        errno = ENOTDIR;
-        return -1;
+    if (journal_fd < 0) {
+        char jpath[PATH_MAX + 16];
+        snprintf(jpath, sizeof(jpath), "%s.journal", fs_image_path);
+        journal_fd = open(jpath, O_RDWR | O_CREAT | O_APPEND, 0644);
     }
     
-    fs->current_dir = dir_idx;
+    off_t jsize = (journal_fd >= 0) ? lseek(journal_fd, 0, SEEK_END) : -1;
+    int rc = (jsize < 0 ||
+              pwrite_full(journal_fd, txn, sizeof(journal_header) + length, jsize) < 0 ||
+              fdatasync(journal_fd) < 0) ? -1 : 0;
+    free(txn);
+    if (rc < 0) return -1;
+    
+    fat_clear_run(pending_map, 0, limit);
+    fat_release_freed();
+    if (jsize + sizeof(journal_header) + length > JOURNAL_CHECKPOINT_BYTES) {
+        return fat_checkpoint();
+    }
     return 0;
 }
 
-void fat_pwd() {
-    if (fs->current_dir == 0) {
-        printf("/\n");
-        return;
+// Commit, write all metadata in place, then start an empty journal
+int fat_checkpoint() {
+    if (fs->sb->current_dir != fs->current_dir) {
+        fs->sb->current_dir = fs->current_dir;
+        fat_mark_dirty(fs->sb, sizeof(fat_superblock));
     }
     
-    char path[PATH_MAX] = {0};
-    uint32_t idx = fs->current_dir;
-    
-    while (idx != 0) {
-        char tmp[PATH_MAX];
-        snprintf(tmp, sizeof(tmp), "/%s%s", fs->dir_entries[idx].name, path);
-        strcpy(path, tmp);
-        idx = fs->dir_entries[idx].parent_entry;
+    if (fat_commit() < 0) return -1;
+    if (fat_flush_dirty(0, fs->sb->blocks_offset, NULL) < 0) return -1;
+    if (fdatasync(fs_fd) < 0) return -1;
+    if (journal_fd >= 0 && (ftruncate(journal_fd, 0) < 0 || fdatasync(journal_fd) < 0)) {
+        return -1;
     }
-    
-    printf("%s\n", path);
+    return 0;
 }
 
-void fat_sync_from_real_file(const char *path) {
-    char realfile[PATH_MAX];
-    snprintf(realfile, sizeof(realfile), "%s/%s", ROOT_PATH, path);
-    
-    // Check if file exists on disk
-    if (access(realfile, F_OK) != 0) {
-        return;
+// Apply every intact transaction from filename's journal to the image file.
+// A torn or corrupt transaction ends the replay; the journal is then reset.
+int fat_journal_replay(const char *filename) {
+    char jpath[PATH_MAX + 16];
+    snprintf(jpath, sizeof(jpath), "%s.journal", filename);
+    int jfd = open(jpath, O_RDWR);
+    if (jfd < 0) return 0;
+    
+    int fd = open(filename, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        close(jfd);
+        return 0;
     }
     
-    uint32_t entry_idx = fat_resolve_path(path);
-    
-    // If file doesn't exist in VFS, create it
-    if (entry_idx == (uint32_t)-1) {
-        printf("[VFS] Auto-creating '%s' in virtual file system\n", path);
-        if (fat_touch(path) < 0) {
-            fprintf(stderr, "[VFS] Failed to create '%s' in virtual file system\n", path);
-            return;
+    int applied = 0;
+    off_t offset = 0;
+    journal_header hdr;
+    while (pread_full(jfd, &hdr, sizeof(hdr), offset) == 0 &&
+           hdr.magic == JOURNAL_MAGIC && hdr.length <= (uint64_t)st.st_size * 2) {
+        uint8_t *txn = malloc(sizeof(hdr) + hdr.length);
+        if (!txn) break;
+        memcpy(txn, &hdr, sizeof(hdr));
+        ((journal_header *)txn)->crc = 0;
+        if (pread_full(jfd, txn + sizeof(hdr), hdr.length, offset + sizeof(hdr)) < 0 ||
+            crc32c(0, txn, sizeof(hdr) + hdr.length) != hdr.crc) {
+            free(txn);
+            break;
         }
-        entry_idx = fat_resolve_path(path);
-        if (entry_idx == (uint32_t)-1) return;
+        
+        uint8_t *p = txn + sizeof(hdr), *end = p + hdr.length;
+        for (uint32_t r = 0; r < hdr.records && p + sizeof(journal_record) <= end; r++) {
+            journal_record rec;
+            memcpy(&rec, p, sizeof(rec));
+            p += sizeof(rec);
+            if (rec.length > (uint64_t)(end - p) || rec.offset + rec.length > (uint64_t)st.st_size) break;
+            pwrite_full(fd, p, rec.length, rec.offset);
+            p += rec.length;
+        }
+        free(txn);
+        applied++;
+        offset += sizeof(hdr) + hdr.length;
     }
     
-    if (fs->dir_entries[entry_idx].is_dir) {
-        return;
+    if (applied) fdatasync(fd);
+    if (ftruncate(jfd, 0) == 0) fdatasync(jfd);
+    close(fd);
+    close(jfd);
+    return applied;
+}
+
+void fat_compact_entries();
+uint32_t fat_check(int verify, int verbose);
+
+// Compact once a quarter of the entry table is dead; MYSH_FS_COMPACT=1
+// compacts whenever any slot is dead and MYSH_FS_COMPACT=0 never does
+int fat_compact_wanted() {
+    const char *value = getenv("MYSH_FS_COMPACT");
+    if (dead_entry_count == 0) return 0;
+    if (value && strcmp(value, "0") == 0) return 0;
+    if (value && strcmp(value, "1") == 0) return 1;
+    return dead_entry_count * 4 >= fs->sb->num_entries;
+}
+
+int fat_save_image(const char *filename) {
+    // Saving the open image is a checkpoint of what changed since the last one
+    if (fs_fd >= 0 && strcmp(filename, fs_image_path) == 0) {
+        if (fat_compact_wanted()) fat_compact_entries();
+        return fat_checkpoint();
     }
     
-    FILE *fp = fopen(realfile, "r");
-    if (!fp) return;
+    fs->sb->current_dir = fs->current_dir;
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) return -1;
     
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    rewind(fp);
+    size_t written = fwrite(fs_image, fs->sb->image_size, 1, fp);
+    fclose(fp);
     
-    if (size > 0) {
-        char *buf = malloc(size);
-        fread(buf, 1, size, fp);
-        fclose(fp);
-        
-        fat_write_file(entry_idx, buf, size);
-        free(buf);
-        printf("[VFS] Synced '%s' to virtual file system (%ld bytes)\n", path, size);
-    } else {
-        fclose(fp);
-    }
-}
-
-/* ---------- Shell builtins ---------- */
-int is_shell_builtin(const char *cmd) {
-    return (strcmp(cmd, "cd") == 0 || strcmp(cmd, "exit") == 0 || 
-            strcmp(cmd, "history") == 0 || strcmp(cmd, "jobs") == 0 ||
-            strcmp(cmd, "ls") == 0 || strcmp(cmd, "cat") == 0 ||
-            strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "touch") == 0 ||
-            strcmp(cmd, "pwd") == 0 || strcmp(cmd, "grep") == 0 ||
-            strcmp(cmd, "rm") == 0 || strcmp(cmd, "rmdir") == 0 ||
-            strcmp(cmd, "head") == 0 || strcmp(cmd, "tail") == 0 ||
-            strcmp(cmd, "mv") == 0);
+    return (written == 1) ? 0 : -1;
 }
 
-int fat_mv(const char *source, const char *dest) {
-    if (!source || !dest) {
-        fprintf(stderr, "mv: missing operand\n");
+int fat_load_image(const char *filename) {
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) return -1;
+    
+    fat_superblock sb;
+    if (pread_full(fd, &sb, sizeof(sb), 0) < 0 || sb.magic != FAT_MAGIC) {
+        close(fd);
         return -1;
     }
     
-    // Find source entry
-    uint32_t src_idx = fat_resolve_path(source);
-    if (src_idx == (uint32_t)-1) {
-        fprintf(stderr, "mv: cannot stat '%s': No such file or directory\n", source);
+    if (sb.version != FAT_VERSION || sb.fat_entry_size != sizeof(uint32_t) ||
+        !fat_valid_geometry(sb.block_size, sb.block_count, sb.max_entries) ||
+        sb.num_entries > sb.max_entries || sb.current_dir >= sb.num_entries) {
+        fprintf(stderr, "%s: unsupported file system version or geometry\n", filename);
+        close(fd);
         return -1;
     }
     
-    // Cannot move root
-    if (src_idx == 0) {
-        fprintf(stderr, "mv: cannot move root directory\n");
+    // Offsets must match what this build would lay out for that geometry
+    fat_superblock expect = sb;
+    fat_compute_layout(&expect);
+    struct stat st;
+    if (memcmp(&expect, &sb, sizeof(sb)) != 0 ||
+        fstat(fd, &st) < 0 || (uint64_t)st.st_size < sb.image_size) {
+        fprintf(stderr, "%s: corrupt superblock\n", filename);
+        close(fd);
         return -1;
     }
     
-    dir_entry *src_entry = &fs->dir_entries[src_idx];
+    uint8_t *image = fat_map_image(fd, &sb);
+    if (image) {
+        fat_attach_image(image, filename, fd, 1);
+        return 0;
+    }
     
-    // Parse destination path
-    char *dest_copy = strdup(dest);
-    char *last_slash = strrchr(dest_copy, '/');
-    char *new_name;
+    image = malloc(sb.image_size);
+    if (!image || pread_full(fd, image, sb.image_size, 0) < 0) {
+        free(image);
+        close(fd);
+        return -1;
+    }
+    fat_attach_image(image, filename, fd, 0);
+    return 0;
+}
+
+/* ---------- Legacy Image Import ---------- */
+// Images written before the superblock existed were a raw dump of a fixed
+// struct: 1024 blocks of 512 bytes, 256 entries and 16-bit FAT entries.
+#define LEGACY_BLOCK_SIZE 512
+#define LEGACY_MAX_BLOCKS 1024
+#define LEGACY_MAX_ENTRIES 256
+#define LEGACY_FAT_EOC 0xFFFF
+
+typedef struct {
+    char name[MAX_FILENAME + 1];
+    uint32_t size;
+    uint16_t first_block;
+    uint8_t is_dir;
+    uint8_t is_used;
+    time_t created;
+    time_t modified;
+    uint32_t parent_entry;
+} legacy_dir_entry;
+
+typedef struct {
+    uint16_t fat_table[LEGACY_MAX_BLOCKS];
+    legacy_dir_entry dir_entries[LEGACY_MAX_ENTRIES];
+    uint8_t blocks[LEGACY_MAX_BLOCKS][LEGACY_BLOCK_SIZE];
+    uint32_t num_entries;
+    uint32_t current_dir;
+} legacy_fat_fs;
+
+int fat_import_legacy(const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return -1;
+    
+    legacy_fat_fs *old = malloc(sizeof(legacy_fat_fs));
+    size_t read = fread(old, sizeof(legacy_fat_fs), 1, fp);
+    int extra = fgetc(fp);
+    fclose(fp);
+    
+    // Build the new image beside the old one and swap it in once complete
+    char tmppath[PATH_MAX];
+    snprintf(tmppath, sizeof(tmppath), "%s.new", filename);
+    if (read != 1 || extra != EOF || old->num_entries > LEGACY_MAX_ENTRIES ||
+        fat_format(tmppath, LEGACY_BLOCK_SIZE, LEGACY_MAX_BLOCKS, LEGACY_MAX_ENTRIES) < 0) {
+        free(old);
+        return -1;
+    }
+    
+    for (uint32_t i = 0; i < old->num_entries; i++) {
+        legacy_dir_entry *src = &old->dir_entries[i];
+        dir_entry *dst = &fs->dir_entries[i];
+        dir_name *dst_name = &fs->dir_names[i];
+        memcpy(dst_name->name, src->name, sizeof(dst_name->name));
+        dst_name->name[MAX_FILENAME] = '\0';
+        dst_name->created = src->created;
+        dst_name->modified = src->modified;
+        dst->name_hash = dir_name_hash(dst_name->name);
+        dst->size = src->size;
+        dst->first_block = (src->first_block == LEGACY_FAT_EOC) ? FAT_EOC : src->first_block;
+        dst->is_dir = src->is_dir;
+        dst->is_used = src->is_used;
+        dst->parent_entry = src->parent_entry;
+        dst->first_child = (uint32_t)-1;
+        dst->next_sibling = (uint32_t)-1;
+    }
+    fs->sb->num_entries = old->num_entries;
+    fs->current_dir = old->current_dir < old->num_entries ? old->current_dir : 0;
+    cwd_invalidate();
+    
+    // The old format used 0 both for "free" and for a link to block 0, so
+    // chains are rebuilt by following each file for as many blocks as its
+    // size needs; everything not reached stays free.
+    for (uint32_t i = 0; i < fs->sb->num_entries; i++) {
+        dir_entry *entry = &fs->dir_entries[i];
+        if (!entry->is_used || entry->is_dir || entry->first_block == FAT_EOC) continue;
+        
+        uint32_t blocks = (entry->size + LEGACY_BLOCK_SIZE - 1) / LEGACY_BLOCK_SIZE;
+        uint32_t current = entry->first_block;
+        for (uint32_t n = 0; n < blocks && current < LEGACY_MAX_BLOCKS; n++) {
+            uint16_t next = old->fat_table[current];
+            int last = (n + 1 == blocks || next == LEGACY_FAT_EOC || next >= LEGACY_MAX_BLOCKS);
+            memcpy(fat_block(current), old->blocks[current], LEGACY_BLOCK_SIZE);
+            fs->fat_table[current] = last ? FAT_EOC : next;
+            if (last) break;
+            current = next;
+        }
+    }
+    
+    free(old);
+    fat_rebuild_free_map();
+    dir_index_rebuild();
+    dir_slots_rebuild();
+    dir_links_rebuild();
+    fat_mark_dirty(fs_image, fs->sb->image_size);
+    fat_update_sums();
+    if (fat_flush_dirty(0, fs->sb->image_size, NULL) < 0 || fdatasync(fs_fd) < 0 ||
+        rename(tmppath, filename) < 0) {
+        unlink(tmppath);
+        return -1;
+    }
+    snprintf(fs_image_path, sizeof(fs_image_path), "%s", filename);
+    return 0;
+}
+
+uint32_t env_geometry(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    if (!value || !*value) return fallback;
+    return (uint32_t)strtoul(value, NULL, 0);
+}
+
+void fat_init() {
+    char imgpath[PATH_MAX];
+    snprintf(imgpath, sizeof(imgpath), "%s/mysh_fs.img", ROOT_PATH);
+    
+    int replayed = fat_journal_replay(imgpath);
+    if (replayed > 0) {
+        printf("Recovered %d journal transaction%s into mysh_fs.img\n", replayed, replayed == 1 ? "" : "s");
+    }
+    
+    // Try to load existing image
+    if (fat_load_image(imgpath) == 0) {
+        printf("Loaded existing file system from mysh_fs.img\n");
+        // The structure is cheap to check; checksums wait for fsck
+        uint32_t problems = fat_check(0, 0);
+        if (problems > 0) {
+            printf("mysh_fs.img: %u problem%s found; run fsck for details\n",
+                   problems, problems == 1 ? "" : "s");
+        }
+        return;
+    }
+    
+    // Never overwrite an image we cannot read, unless it is the old format
+    if (access(imgpath, F_OK) == 0) {
+        if (fat_import_legacy(imgpath) < 0) {
+            dief("mysh_fs.img: not a mysh file system image (move it aside to start fresh)\n");
+        }
+        printf("Converted mysh_fs.img from the fixed-size format\n");
+        return;
+    }
+    
+    // Create new file system; geometry may be overridden from the environment
+    uint32_t block_size = env_geometry("MYSH_FS_BLOCK_SIZE", DEFAULT_BLOCK_SIZE);
+    uint32_t block_count = env_geometry("MYSH_FS_BLOCKS", DEFAULT_BLOCKS);
+    uint32_t max_entries = env_geometry("MYSH_FS_ENTRIES", DEFAULT_ENTRIES);
+    
+    printf("Creating new file system...\n");
+    if (fat_format(imgpath, block_size, block_count, max_entries) < 0) {
+        dief("mysh: invalid file system geometry (%u blocks of %u bytes, %u entries)\n",
+             block_count, block_size, max_entries);
+    }
+    
+    // Create a sample readme.txt file
+    dir_entry *readme = &fs->dir_entries[1];
+    dir_set_name(1, "readme.txt");
+    const char *content = "This is a virtual FAT file system.\nWelcome to mysh!\n";
+    readme->size = strlen(content);
+    readme->first_block = 0;
+    readme->is_dir = 0;
+    readme->is_used = 1;
+    fs->dir_names[1].created = time(NULL);
+    dir_set_modified(1);
+    readme->parent_entry = 0;
+    readme->first_child = (uint32_t)-1;
+    readme->next_sibling = (uint32_t)-1;
+    
+    // Write content to first block
+    memcpy(fat_block(0), content, strlen(content));
+    fat_mark_block(0);
+    fat_set_next(0, FAT_EOC);
+    
+    fs->sb->num_entries = 2;
+    fat_mark_entry(1);
+    dir_index_insert(1);
+    dir_link_child(1);
+    fat_mark_dirty(fs->sb, sizeof(fat_superblock));
+    fat_rebuild_free_map();
+    
+    // Save initial state
+    fat_save_image(imgpath);
+}
+
+// A reused block is about to be overwritten; there is nothing left to scrub
+void fat_unscrub(uint32_t block) {
+    if (scrub_map && (scrub_map[block / 64] & (1ULL << (block % 64)))) {
+        scrub_map[block / 64] &= ~(1ULL << (block % 64));
+        scrub_pending--;
+    }
+}
+
+// Clear up to max freed blocks; called between commands under ZERO_SCRUB
+void fat_scrub_step(uint32_t max) {
+    uint32_t w = 0;
+    while (scrub_pending > 0 && max > 0 && w < free_map_words) {
+        if (scrub_map[w] == 0) {
+            w++;
+            continue;
+        }
+        uint32_t b = w * 64 + __builtin_ctzll(scrub_map[w]);
+        fat_unscrub(b);
+        
+        // Skip the write when the block is already clean
+        uint8_t *blk = fat_block(b);
+        if (blk[0] != 0 || memcmp(blk, blk + 1, fs->block_size - 1) != 0) {
+            memset(blk, 0, fs->block_size);
+            fat_mark_block(b);
+        }
+        max--;
+    }
+}
+
+uint32_t fat_alloc_block() {
+    if (free_block_count == 0) return FAT_EOC;
+    
+    // Next-fit: resume at the word that satisfied the last request and
+    // skip fully allocated words 64 blocks at a time
+    for (uint32_t n = 0; n < free_map_words; n++) {
+        uint32_t w = (free_map_hint + n) % free_map_words;
+        if (free_map[w] == 0) continue;
+        
+        uint32_t i = w * 64 + __builtin_ctzll(free_map[w]);
+        free_map[w] &= free_map[w] - 1;  // Clear lowest set bit
+        free_block_count--;
+        free_map_hint = w;
+        fat_unscrub(i);
+        fat_set_next(i, FAT_EOC);
+        return i;
+    }
+    return FAT_EOC;
+}
+
+// Find the free run that starts at or after block from; returns 0 when the
+// rest of the volume has no free block
+int fat_next_free_run(uint32_t from, uint32_t *start, uint32_t *len) {
+    uint32_t w = from / 64;
+    if (w >= free_map_words) return 0;
+    uint64_t word = free_map[w] & (~0ULL << (from % 64));
+    while (word == 0) {
+        if (++w >= free_map_words) return 0;
+        word = free_map[w];
+    }
+    uint32_t first = w * 64 + __builtin_ctzll(word);
+    
+    // Extend over set bits: look for the first allocated block after first
+    uint32_t end;
+    word = ~free_map[w] & (~0ULL << (first % 64));
+    while (word == 0 && ++w < free_map_words) word = ~free_map[w];
+    end = (w < free_map_words) ? w * 64 + __builtin_ctzll(word) : free_map_words * 64;
+    if (end > fs->block_count) end = fs->block_count;
+    
+    *start = first;
+    *len = end - first;
+    return 1;
+}
+
+#define EXTENT_SCAN_RUNS 64  // Free runs one allocation looks at
+
+// Next fit: the first free run at or after the allocation cursor that holds
+// want blocks, wrapping around once. After max_runs runs the largest one
+// seen is taken instead, so a fragmented volume costs a bounded scan rather
+// than a pass over the whole bitmap. Returns its first block and sets *got
+// to the blocks it can give (at most want), or returns FAT_EOC when nothing
+// is free.
+uint32_t fat_find_extent(uint32_t want, uint32_t *got, uint32_t max_runs) {
+    uint32_t largest = FAT_EOC, largest_len = 0;
+    uint32_t cursor = free_map_hint * 64, start, len, pos, runs = 0;
+    int wrapped = 0;
+    
+    *got = 0;
+    if (free_block_count == 0 || want == 0) return FAT_EOC;
+    if (cursor >= fs->block_count) cursor = 0;
+    
+    pos = cursor;
+    while (runs < max_runs) {
+        if (!fat_next_free_run(pos, &start, &len) || (wrapped && start >= cursor)) {
+            if (wrapped) break;
+            wrapped = 1;
+            pos = 0;
+            continue;
+        }
+        runs++;
+        if (len >= want) {
+            *got = want;
+            return start;
+        }
+        if (len > largest_len) {
+            largest = start;
+            largest_len = len;
+        }
+        pos = start + len;
+    }
+    *got = largest_len;
+    return largest;
+}
+
+// Allocate blocks [start, start + count), linked in order, and move the
+// cursor past them
+void fat_take_extent(uint32_t start, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t b = start + i;
+        free_map[b / 64] &= ~(1ULL << (b % 64));
+        fat_unscrub(b);
+        fat_set_next(b, (i + 1 < count) ? b + 1 : FAT_EOC);
+    }
+    free_block_count -= count;
+    free_map_hint = ((start + count) / 64) % free_map_words;
+}
+
+// Allocate up to want contiguous blocks, already linked in order, so the
+// caller can chain fragments when no extent is large enough. Returns the
+// first block, or FAT_EOC.
+uint32_t fat_alloc_extent(uint32_t want, uint32_t *got) {
+    uint32_t start = fat_find_extent(want, got, EXTENT_SCAN_RUNS);
+    if (start == FAT_EOC) return FAT_EOC;
+    fat_take_extent(start, *got);
+    return start;
+}
+
+void fat_free_chain(uint32_t start_block) {
+    uint32_t current = start_block;
+    // A block already free ends the walk, so a corrupt chain that loops back
+    // on itself is freed once rather than forever
+    while (current < fs->block_count && fs->fat_table[current] != FAT_FREE) {
+        // Another chain still runs through this block and everything after it
+        if (block_shares[current] > 0) {
+            block_shares[current]--;
+            block_shares_total--;
+            break;
+        }
+        
+        uint32_t next = fs->fat_table[current];
+        if (dedup_next) dedup_remove(current);
+        fat_set_next(current, FAT_FREE);
+        release_map[current / 64] |= 1ULL << (current % 64);
+        release_count++;
+        current = next;
+    }
+}
+
+// Make the blocks freed before a durable commit allocatable. Eager zeroing
+// waits until here too, so a crash never finds zeros in a committed file.
+void fat_release_freed() {
+    for (uint32_t w = 0; release_count > 0 && w < free_map_words; w++) {
+        uint64_t word = release_map[w];
+        if (word == 0) continue;
+        uint32_t n = __builtin_popcountll(word);
+        for (uint64_t bits = word; zero_policy == ZERO_EAGER && bits; bits &= bits - 1) {
+            uint32_t b = w * 64 + __builtin_ctzll(bits);
+            memset(fat_block(b), 0, fs->block_size);
+            fat_mark_block(b);
+        }
+        release_map[w] = 0;
+        release_count -= n;
+        free_map[w] |= word;
+        free_block_count += n;
+        if (scrub_map) {
+            scrub_map[w] |= word;
+            scrub_pending += n;
+        }
+    }
+}
+
+// Rebuild the image with a directory table twice as large. Like a legacy
+// import, the new image is written beside the old one and renamed over it,
+// so a crash leaves one complete image or the other.
+int fat_grow_entries() {
+    uint32_t max_entries = fs->sb->max_entries;
+    if (max_entries >= FAT_MAX_ENTRIES) {
+        errno = ENOSPC;
+        return -1;
+    }
+    max_entries = (max_entries > FAT_MAX_ENTRIES / 2) ? FAT_MAX_ENTRIES : max_entries * 2;
+    if (fat_checkpoint() < 0) return -1;
+    
+    // Keep the old image open while the new one is filled from it
+    fat_superblock old_sb = *fs->sb;
+    uint8_t *old_image = fs_image;
+    int old_fd = fs_fd, old_mapped = fs_mapped;
+    uint32_t current_dir = fs->current_dir;
+    char filename[PATH_MAX], tmppath[PATH_MAX + 8];
+    snprintf(filename, sizeof(filename), "%s", fs_image_path);
+    snprintf(tmppath, sizeof(tmppath), "%s.new", filename);
+    if (journal_fd >= 0) close(journal_fd);
+    journal_fd = -1;
+    fs_image = NULL;
+    
+    if (fat_format(tmppath, old_sb.block_size, old_sb.block_count, max_entries) < 0) {
+        int saved = errno;
+        fat_attach_image(old_image, filename, old_fd, old_mapped);
+        errno = saved;
+        return -1;
+    }
+    
+    memcpy(fs->fat_table, old_image + old_sb.fat_offset, (size_t)old_sb.block_count * sizeof(uint32_t));
+    memcpy(fs->block_sums, old_image + old_sb.sums_offset, (size_t)old_sb.block_count * sizeof(uint32_t));
+    memcpy(fs->block_lines, old_image + old_sb.lines_offset, (size_t)old_sb.block_count * sizeof(uint32_t));
+    memcpy(fs->dir_entries, old_image + old_sb.entries_offset, (size_t)old_sb.num_entries * sizeof(dir_entry));
+    memcpy(fs->dir_names, old_image + old_sb.names_offset, (size_t)old_sb.num_entries * sizeof(dir_name));
+    fs->sb->num_entries = old_sb.num_entries;
+    fs->sb->current_dir = current_dir;
+    fs->sb->volume_id = old_sb.volume_id;  // Its snapshots still apply
+    fs->current_dir = current_dir;
+    fat_mark_dirty(fs_image, fs->sb->blocks_offset);
+    
+    // Only blocks in use are copied; the rest of the new file stays sparse
+    for (uint32_t b = 0; b < fs->block_count; b++) {
+        if (fs->fat_table[b] == FAT_FREE) continue;
+        memcpy(fat_block(b), old_image + old_sb.blocks_offset + (size_t)b * old_sb.block_size, fs->block_size);
+        fat_mark_block(b);
+    }
+    snprintf(fs_image_path, sizeof(fs_image_path), "%s", filename);  // Finds its snapshots
+    fat_rebuild_free_map();
+    dir_index_rebuild();
+    dir_slots_rebuild();
+    
+    if (fat_flush_dirty(0, fs->sb->image_size, NULL) < 0 || fdatasync(fs_fd) < 0 ||
+        rename(tmppath, filename) < 0) {
+        int saved = errno;
+        unlink(tmppath);
+        fat_detach_image();
+        fat_attach_image(old_image, filename, old_fd, old_mapped);
+        errno = saved;
+        return -1;
+    }
+    snprintf(fs_image_path, sizeof(fs_image_path), "%s", filename);
+    
+    if (old_mapped) {
+        munmap(old_image, old_sb.image_size);
+    } else {
+        free(old_image);
+    }
+    close(old_fd);
+    return 0;
+}
+
+// Claim a slot for a new entry: the lowest dead slot, else the next one past
+// num_entries, growing the table when it is full. Returns (uint32_t)-1.
+uint32_t fat_alloc_entry() {
+    if (dead_entry_count > 0) {
+        for (uint32_t w = 0; w < (fs->sb->num_entries + 63) / 64; w++) {
+            if (dead_entry_map[w] == 0) continue;
+            uint32_t idx = w * 64 + __builtin_ctzll(dead_entry_map[w]);
+            dead_entry_map[w] &= ~(1ULL << (idx % 64));
+            dead_entry_count--;
+            return idx;
+        }
+    }
+    
+    if (fs->sb->num_entries >= fs->sb->max_entries && fat_grow_entries() < 0) {
+        errno = ENOSPC;
+        return (uint32_t)-1;
+    }
+    fat_mark_dirty(fs->sb, sizeof(fat_superblock));
+    return fs->sb->num_entries++;
+}
+
+// Return a slot whose entry was just marked unused. Dead slots at the end
+// of the table are dropped so scans stop at the last live entry.
+void fat_release_entry(uint32_t entry_idx) {
+    dead_entry_map[entry_idx / 64] |= 1ULL << (entry_idx % 64);
+    dead_entry_count++;
+    
+    while (fs->sb->num_entries > 1 && !fs->dir_entries[fs->sb->num_entries - 1].is_used) {
+        uint32_t last = --fs->sb->num_entries;
+        dead_entry_map[last / 64] &= ~(1ULL << (last % 64));
+        dead_entry_count--;
+    }
+    fat_mark_dirty(fs->sb, sizeof(fat_superblock));
+}
+
+uint32_t compact_remap(const uint32_t *remap, uint32_t idx) {
+    return (idx == (uint32_t)-1) ? idx : remap[idx];
+}
+
+// Move live entries down into a dense prefix of the table. Entry indices
+// change, so this only runs at save time, with no handles open.
+void fat_compact_entries() {
+    uint32_t n = fs->sb->num_entries;
+    if (dead_entry_count == 0 || fs->current_dir >= n) return;
+    uint32_t *remap = malloc(n * sizeof(uint32_t));
+    if (!remap) return;
+    
+    uint32_t live = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        remap[i] = fs->dir_entries[i].is_used ? live++ : (uint32_t)-1;
+    }
+    
+    // remap[i] <= i, so walking upwards never overwrites an unmoved entry
+    for (uint32_t i = 0; i < n; i++) {
+        if (remap[i] == (uint32_t)-1) continue;
+        dir_entry entry = fs->dir_entries[i];
+        entry.parent_entry = compact_remap(remap, entry.parent_entry);
+        entry.first_child = compact_remap(remap, entry.first_child);
+        entry.next_sibling = compact_remap(remap, entry.next_sibling);
+        fs->dir_entries[remap[i]] = entry;
+        if (remap[i] != i) fs->dir_names[remap[i]] = fs->dir_names[i];
+    }
+    memset(&fs->dir_entries[live], 0, (n - live) * sizeof(dir_entry));
+    memset(&fs->dir_names[live], 0, (n - live) * sizeof(dir_name));
+    
+    fs->current_dir = remap[fs->current_dir];
+    fs->sb->num_entries = live;
+    fat_mark_dirty(fs->dir_entries, n * sizeof(dir_entry));
+    fat_mark_dirty(fs->dir_names, n * sizeof(dir_name));
+    fat_mark_dirty(fs->sb, sizeof(fat_superblock));
+    free(remap);
+    
+    dir_index_rebuild();
+    dir_slots_rebuild();
+    dcache_invalidate();
+}
+
+// Names are only compared once parent and hash match
+uint32_t fat_find_entry(const char *name, uint32_t parent) {
+    uint32_t hash = dir_name_hash(name);
+    uint32_t i = dir_index_buckets[dir_index_bucket(parent, hash)];
+    while (i != (uint32_t)-1) {
+        if (fs->dir_entries[i].parent_entry == parent && fs->dir_entries[i].name_hash == hash &&
+            strcmp(fs->dir_names[i].name, name) == 0) {
+            return i;
+        }
+        i = dir_index_next[i];
+    }
+    return (uint32_t)-1;
+}
+
+uint32_t dcache_set(uint32_t cwd, const char *path) {
+    uint32_t h = 2166136261u ^ cwd;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return (h ^ (h >> 16)) % DCACHE_SETS;
+}
+
+uint32_t dcache_lookup(uint32_t cwd, const char *path) {
+    dcache_slot *set = dcache[dcache_set(cwd, path)];
+    for (int w = 0; w < DCACHE_WAYS; w++) {
+        if (set[w].generation == dcache_generation && set[w].cwd == cwd &&
+            strcmp(set[w].path, path) == 0) {
+            set[w].last_used = ++dcache_clock;
+            return set[w].entry;
+        }
+    }
+    return (uint32_t)-1;
+}
+
+void dcache_insert(uint32_t cwd, const char *path, uint32_t entry) {
+    dcache_slot *set = dcache[dcache_set(cwd, path)];
+    dcache_slot *victim = &set[0];
+    for (int w = 0; w < DCACHE_WAYS; w++) {
+        if (set[w].generation != dcache_generation) {
+            victim = &set[w];
+            break;
+        }
+        if (set[w].last_used < victim->last_used) victim = &set[w];
+    }
+    
+    free(victim->path);
+    victim->path = strdup(path);
+    victim->cwd = cwd;
+    victim->entry = entry;
+    victim->generation = dcache_generation;
+    victim->last_used = ++dcache_clock;
+}
+
+uint32_t fat_walk_path(const char *path) {
+    uint32_t current = (path[0] == '/') ? 0 : fs->current_dir;
+    char *copy = strdup(path);
+    char *tok = strtok(copy, "/");
+    
+    while (tok) {
+        if (strcmp(tok, ".") == 0) {
+            tok = strtok(NULL, "/");
+            continue;
+        }
+        if (strcmp(tok, "..") == 0) {
+            current = fs->dir_entries[current].parent_entry;
+            tok = strtok(NULL, "/");
+            continue;
+        }
+        
+        uint32_t next = fat_find_entry(tok, current);
+        if (next == (uint32_t)-1) {
+            free(copy);
+            return (uint32_t)-1;
+        }
+        current = next;
+        tok = strtok(NULL, "/");
+    }
+    
+    free(copy);
+    return current;
+}
+
+uint32_t fat_resolve_path(const char *path) {
+    if (!path || path[0] == '\0') return fs->current_dir;
+    if (strcmp(path, "/") == 0) return 0;
+    
+    // Absolute paths resolve the same from any working directory
+    uint32_t cwd = (path[0] == '/') ? (uint32_t)-1 : fs->current_dir;
+    uint32_t entry = dcache_lookup(cwd, path);
+    if (entry != (uint32_t)-1) return entry;
+    
+    entry = fat_walk_path(path);
+    if (entry != (uint32_t)-1) dcache_insert(cwd, path, entry);
+    return entry;
+}
+
+int fat_mkdir(const char *path) {
+    if (!path) return -1;
+    
+    char *copy = strdup(path);
+    char *last = strrchr(copy, '/');
+    char *name;
+    uint32_t parent;
+    
+    if (!last) {
+        parent = fs->current_dir;
+        name = copy;
+    } else {
+        *last = '\0';
+        parent = fat_resolve_path(copy);
+        name = last + 1;
+        if (parent == (uint32_t)-1) {
+            free(copy);
+            return -1;
+        }
+    }
+    
+    // Check if already exists
+    if (fat_find_entry(name, parent) != (uint32_t)-1) {
+        free(copy);
+        errno = EEXIST;
+        return -1;
+    }
+    
+    // Claim a slot, reusing one freed by rm or rmdir if there is one
+    uint32_t idx = fat_alloc_entry();
+    if (idx == (uint32_t)-1) {
+        free(copy);
+        return -1;
+    }
+    
+    // Create new directory entry
+    dir_entry *new_dir = &fs->dir_entries[idx];
+    dir_set_name(idx, name);
+    new_dir->size = 0;
+    new_dir->first_block = FAT_EOC;
+    new_dir->is_dir = 1;
+    new_dir->is_used = 1;
+    new_dir->flags = 0;
+    fs->dir_names[idx].created = time(NULL);
+    dir_set_modified(idx);
+    new_dir->parent_entry = parent;
+    new_dir->first_child = (uint32_t)-1;
+    
+    fat_mark_entry(idx);
+    dir_index_insert(idx);
+    dir_link_child(idx);
+    free(copy);
+    return 0;
+}
+
+int fat_touch(const char *path) {
+    if (!path) return -1;
+    
+    char *copy = strdup(path);
+    char *last = strrchr(copy, '/');
+    char *name;
+    uint32_t parent;
+    
+    if (!last) {
+        parent = fs->current_dir;
+        name = copy;
+    } else {
+        *last = '\0';
+        parent = fat_resolve_path(copy);
+        name = last + 1;
+        if (parent == (uint32_t)-1) {
+            free(copy);
+            return -1;
+        }
+    }
+    
+    // Check if already exists
+    uint32_t existing = fat_find_entry(name, parent);
+    if (existing != (uint32_t)-1) {
+        if (fs->dir_entries[existing].is_dir) {
+            free(copy);
+            errno = EISDIR;
+            return -1;
+        }
+        // Update modification time
+        dir_set_modified(existing);
+        free(copy);
+        return 0;
+    }
+    
+    // Claim a slot, reusing one freed by rm or rmdir if there is one
+    uint32_t idx = fat_alloc_entry();
+    if (idx == (uint32_t)-1) {
+        free(copy);
+        return -1;
+    }
+    
+    // Create new file entry
+    dir_entry *new_file = &fs->dir_entries[idx];
+    dir_set_name(idx, name);
+    new_file->size = 0;
+    new_file->first_block = FAT_EOC;
+    new_file->is_dir = 0;
+    new_file->is_used = 1;
+    new_file->flags = 0;
+    fs->dir_names[idx].created = time(NULL);
+    dir_set_modified(idx);
+    new_file->parent_entry = parent;
+    new_file->first_child = (uint32_t)-1;
+    
+    fat_mark_entry(idx);
+    dir_index_insert(idx);
+    dir_link_child(idx);
+    
+    // DON'T create empty real file here anymore
+    // Let the editor create it naturally
+    
+    free(copy);
+    return 0;
+}
+
+/* ---------- Block Compression ---------- */
+// A compressed file's chain holds one frame per FAT_COMPRESS_CHUNK bytes of
+// content: a fat_frame header, then the chunk in LZ4 block format, or the
+// chunk as is when compressing does not shrink it (stored_len == raw_len).
+// entry->size stays the uncompressed length. Frames decode independently,
+// so readers skip over the ones before their position without decoding.
+#define FAT_COMPRESS_CHUNK 4096
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5  // A block always ends in at least this many literals
+#define LZ_MATCH_LIMIT 12   // No match may start in the last 12 bytes
+
+typedef struct {
+    uint16_t raw_len;
+    uint16_t stored_len;
+} fat_frame;
+
+// Append one sequence (literals, then a match unless match_len is 0)
+int lz_emit(uint8_t *dst, size_t cap, size_t *op, const uint8_t *lit, size_t lit_len,
+            size_t offset, size_t match_len) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (match_len ? 3 + match_len / 255 : 0);
+    if (*op + need > cap) return 0;
+    
+    uint8_t *token = dst + (*op)++;
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15) {
+        size_t l = lit_len - 15;
+        for (; l >= 255; l -= 255) dst[(*op)++] = 255;
+        dst[(*op)++] = l;
+    }
+    memcpy(dst + *op, lit, lit_len);
+    *op += lit_len;
+    
+    if (match_len) {
+        size_t m = match_len - LZ_MIN_MATCH;
+        dst[(*op)++] = offset & 0xFF;
+        dst[(*op)++] = offset >> 8;
+        *token |= (m >= 15) ? 15 : m;
+        if (m >= 15) {
+            for (m -= 15; m >= 255; m -= 255) dst[(*op)++] = 255;
+            dst[(*op)++] = m;
+        }
+    }
+    return 1;
+}
+
+// Greedy single-probe LZ77 into dst. Returns the compressed length, or 0 if
+// it would not fit in cap bytes. len must be at most 64 KiB.
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint16_t table[1 << LZ_HASH_BITS];
+    size_t ip = 0, anchor = 0, op = 0;
+    memset(table, 0, sizeof(table));
+    
+    if (len > LZ_MATCH_LIMIT) {
+        size_t limit = len - LZ_MATCH_LIMIT;
+        ip = 1;
+        while (ip < limit) {
+            uint32_t seq, cand;
+            memcpy(&seq, src + ip, 4);
+            uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+            size_t ref = table[h];
+            table[h] = ip;
+            memcpy(&cand, src + ref, 4);
+            if (cand != seq) {
+                ip++;
+                continue;
+            }
+            
+            size_t match_len = LZ_MIN_MATCH;
+            while (ip + match_len < len - LZ_LAST_LITERALS && src[ref + match_len] == src[ip + match_len]) {
+                match_len++;
+            }
+            if (!lz_emit(dst, cap, &op, src + anchor, ip - anchor, ip - ref, match_len)) return 0;
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+    
+    if (!lz_emit(dst, cap, &op, src + anchor, len - anchor, 0, 0)) return 0;
+    return op;
+}
+
+// Decode exactly raw_len bytes; -1 if the input is malformed
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t raw_len) {
+    size_t ip = 0, op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > len - ip || lit > raw_len - op) return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == len) break;  // The last sequence has no match
+        
+        if (len - ip < 2) return -1;
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        size_t match_len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > op || match_len > raw_len - op) return -1;
+        
+        // Byte by byte: a match may overlap the bytes it produces
+        for (size_t i = 0; i < match_len; i++, op++) dst[op] = dst[op - offset];
+    }
+    return (op == raw_len) ? 0 : -1;
+}
+
+// Build the framed stream for size bytes of content
+uint8_t *fat_compress_stream(const char *data, size_t size, size_t *out_len) {
+    size_t frames = (size + FAT_COMPRESS_CHUNK - 1) / FAT_COMPRESS_CHUNK;
+    uint8_t *stream = malloc(size + frames * sizeof(fat_frame));
+    if (!stream) return NULL;
+    
+    size_t op = 0;
+    for (size_t offset = 0; offset < size; offset += FAT_COMPRESS_CHUNK) {
+        size_t raw_len = (size - offset > FAT_COMPRESS_CHUNK) ? FAT_COMPRESS_CHUNK : size - offset;
+        const uint8_t *raw = (const uint8_t *)data + offset;
+        uint8_t *body = stream + op + sizeof(fat_frame);
+        
+        size_t stored_len = lz_compress(raw, raw_len, body, raw_len - 1);
+        if (stored_len == 0) {
+            memcpy(body, raw, raw_len);
+            stored_len = raw_len;
+        }
+        fat_frame frame = { (uint16_t)raw_len, (uint16_t)stored_len };
+        memcpy(stream + op, &frame, sizeof(frame));
+        op += sizeof(frame) + stored_len;
+    }
+    *out_len = op;
+    return stream;
+}
+
+// Copy len bytes of a chain starting *off bytes into *block and advance
+// past them; buf may be NULL to skip. Returns -1 if the chain ends first.
+int fat_stream_read(uint32_t *block, size_t *off, uint8_t *buf, size_t len) {
+    while (len > 0) {
+        if (*off == fs->block_size) {
+            *block = fs->fat_table[*block];
+            *off = 0;
+        }
+        if (*block >= fs->block_count) return -1;
+        
+        size_t n = fs->block_size - *off;
+        if (n > len) n = len;
+        if (buf) {
+            memcpy(buf, fat_block(*block) + *off, n);
+            buf += n;
+        }
+        *off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* ---------- Open File Handles ---------- */
+// A handle remembers the block holding its position, so sequential reads
+// walk the chain once instead of restarting from first_block. For a
+// compressed file it keeps the decoded chunk and the next frame instead.
+// fat_span() hands out pointers into the blocks themselves, so the text
+// builtins read a file without copying it.
+
+typedef struct {
+    uint32_t entry;
+    size_t pos;           // Byte offset of the cursor
+    uint32_t block;       // Block holding block_start
+    size_t block_start;   // File offset of the first byte of block
+    uint8_t *chunk;       // Decoded frame, then room for its stored bytes
+    size_t chunk_start;   // File offset of chunk[0]
+    size_t chunk_len;
+    size_t next_start;    // File offset of the next frame's content
+    uint32_t frame_block; // Stream position of the next frame header
+    size_t frame_off;
+} fat_file;
+
+fat_file *fat_open(uint32_t entry_idx) {
+    if (entry_idx >= fs->sb->num_entries || !fs->dir_entries[entry_idx].is_used) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if (fs->dir_entries[entry_idx].is_dir) {
+        errno = EISDIR;
+        return NULL;
+    }
+    
+    fat_file *f = malloc(sizeof(fat_file));
+    if (!f) return NULL;
+    f->entry = entry_idx;
+    f->pos = 0;
+    f->block = fs->dir_entries[entry_idx].first_block;
+    f->block_start = 0;
+    f->chunk = NULL;
+    f->chunk_start = f->chunk_len = f->next_start = 0;
+    f->frame_block = f->block;
+    f->frame_off = 0;
+    
+    if (fs->dir_entries[entry_idx].flags & DIR_COMPRESSED) {
+        f->chunk = malloc(2 * FAT_COMPRESS_CHUNK);
+        if (!f->chunk) {
+            free(f);
+            return NULL;
+        }
+    }
+    return f;
+}
+
+// Decode the frame holding f->pos. Frames before it are skipped by their
+// stored length; moving backwards restarts from the first frame.
+int fat_load_chunk(fat_file *f) {
+    if (f->pos < f->chunk_start) {
+        f->frame_block = fs->dir_entries[f->entry].first_block;
+        f->frame_off = 0;
+        f->next_start = 0;
+    }
+    f->chunk_start = f->chunk_len = 0;
+    
+    while (1) {
+        fat_frame frame;
+        if (fat_stream_read(&f->frame_block, &f->frame_off, (uint8_t *)&frame, sizeof(frame)) < 0 ||
+            frame.raw_len == 0 || frame.raw_len > FAT_COMPRESS_CHUNK || frame.stored_len > frame.raw_len) {
+            errno = EIO;
+            return -1;
+        }
+        
+        if (f->pos >= f->next_start + frame.raw_len) {
+            if (fat_stream_read(&f->frame_block, &f->frame_off, NULL, frame.stored_len) < 0) return -1;
+            f->next_start += frame.raw_len;
+            continue;
+        }
+        
+        uint8_t *stored = (frame.stored_len == frame.raw_len) ? f->chunk : f->chunk + FAT_COMPRESS_CHUNK;
+        if (fat_stream_read(&f->frame_block, &f->frame_off, stored, frame.stored_len) < 0 ||
+            (stored != f->chunk && lz_decompress(stored, frame.stored_len, f->chunk, frame.raw_len) < 0)) {
+            errno = EIO;
+            return -1;
+        }
+        f->chunk_start = f->next_start;
+        f->chunk_len = frame.raw_len;
+        f->next_start += frame.raw_len;
+        return 0;
+    }
+}
+
+// Point *data at the next stretch of the file that is contiguous in memory
+// and advance past it: a run of consecutive blocks, or the rest of the
+// decoded chunk of a compressed file. Returns its length (at most max), 0
+// at the end. Nothing is copied; *data stays valid until the next call.
+size_t fat_span(fat_file *f, const char **data, size_t max) {
+    size_t size = fs->dir_entries[f->entry].size;
+    size_t block_size = fs->block_size;
+    if (f->pos >= size) return 0;
+    size_t len = size - f->pos;
+    if (len > max) len = max;
+    
+    if (f->chunk) {
+        if (f->pos < f->chunk_start || f->pos >= f->chunk_start + f->chunk_len) {
+            if (fat_load_chunk(f) < 0) return 0;
+        }
+        size_t n = f->chunk_start + f->chunk_len - f->pos;
+        if (n > len) n = len;
+        *data = (const char *)f->chunk + (f->pos - f->chunk_start);
+        f->pos += n;
+        return n;
+    }
+    
+    while (f->pos - f->block_start >= block_size && f->block < fs->block_count) {
+        f->block = fs->fat_table[f->block];
+        f->block_start += block_size;
+    }
+    if (f->block >= fs->block_count) return 0;  // Chain is shorter than size
+    
+    size_t in_block = f->pos - f->block_start;
+    uint32_t run = 1;
+    while (run * block_size - in_block < len &&
+           f->block + run < fs->block_count && fs->fat_table[f->block + run - 1] == f->block + run) {
+        run++;
+    }
+    size_t n = run * block_size - in_block;
+    if (n > len) n = len;
+    *data = (const char *)fat_block(f->block) + in_block;
+    f->pos += n;
+    return n;
+}
+
+size_t fat_read(fat_file *f, void *buf, size_t len) {
+    size_t done = 0, n;
+    const char *span;
+    while (done < len && (n = fat_span(f, &span, len - done)) > 0) {
+        memcpy((char *)buf + done, span, n);
+        done += n;
+    }
+    return done;
+}
+
+long fat_seek(fat_file *f, long offset, int whence) {
+    long base = 0;
+    if (whence == SEEK_CUR) base = f->pos;
+    else if (whence == SEEK_END) base = fs->dir_entries[f->entry].size;
+    
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    // Moving backwards past the cached block restarts the walk
+    f->pos = base + offset;
+    if (f->pos < f->block_start) {
+        f->block = fs->dir_entries[f->entry].first_block;
+        f->block_start = 0;
+    }
+    return f->pos;
+}
+
+void fat_close(fat_file *f) {
+    free(f->chunk);
+    free(f);
+}
+
+// Store nbytes in a new chain, one contiguous extent at a time. Returns the
+// first block, or FAT_EOC when the volume fills up.
+uint32_t fat_write_extents(const char *bytes, size_t nbytes) {
+    size_t block_size = fs->block_size;
+    size_t blocks_needed = (nbytes + block_size - 1) / block_size;
+    uint32_t first = FAT_EOC, prev = FAT_EOC;
+    size_t offset = 0;
+    
+    while (blocks_needed > 0) {
+        uint32_t got;
+        uint32_t block = fat_alloc_extent(blocks_needed, &got);
+        if (block == FAT_EOC) {
+            // Out of space, free what we allocated
+            if (first != FAT_EOC) fat_free_chain(first);
+            return FAT_EOC;
+        }
+        
+        size_t to_copy = (nbytes - offset > got * block_size) ? got * block_size : (nbytes - offset);
+        memcpy(fat_block(block), bytes + offset, to_copy);
+        memset(fat_block(block) + to_copy, 0, got * block_size - to_copy);  // Tail past EOF
+        fat_mark_dirty(fat_block(block), got * block_size);
+        
+        if (first == FAT_EOC) {
+            first = block;
+        } else {
+            fat_set_next(prev, block);
+        }
+        prev = block + got - 1;
+        offset += to_copy;
+        blocks_needed -= got;
+    }
+    return first;
+}
+
+// Like fat_write_extents(), but built back to front so each block's
+// successor is known: a block whose content and successor match an
+// existing block is linked to that block instead of being allocated.
+uint32_t fat_write_dedup(const char *bytes, size_t nbytes) {
+    size_t block_size = fs->block_size;
+    size_t blocks = (nbytes + block_size - 1) / block_size;
+    uint8_t *last = calloc(1, block_size);
+    uint32_t next = FAT_EOC;
+    if (!last) return FAT_EOC;
+    
+    for (size_t i = blocks; i-- > 0;) {
+        const uint8_t *content = (const uint8_t *)bytes + i * block_size;
+        if ((i + 1) * block_size > nbytes) {
+            memcpy(last, content, nbytes - i * block_size);  // Zero padded past EOF
+            content = last;
+        }
+        
+        uint32_t block = dedup_find(content, next);
+        if (block != FAT_EOC) {
+            // block already links to next; the reference taken for a new link is not needed
+            if (next != FAT_EOC && block_shares[next] > 0) {
+                block_shares[next]--;
+                block_shares_total--;
+            }
+            block_shares[block]++;
+            block_shares_total++;
+        } else {
+            block = fat_alloc_block();
+            if (block == FAT_EOC) {
+                if (next != FAT_EOC) fat_free_chain(next);
+                free(last);
+                return FAT_EOC;
+            }
+            memcpy(fat_block(block), content, block_size);
+            fat_mark_block(block);
+            fat_set_next(block, next);
+            dedup_insert(block);
+        }
+        next = block;
+    }
+    free(last);
+    return next;
+}
+
+int fat_write_file(uint32_t entry_idx, const char *data, size_t size) {
+    if (entry_idx >= fs->sb->num_entries || !fs->dir_entries[entry_idx].is_used) {
+        return -1;
+    }
+    
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    if (entry->is_dir) return -1;
+    
+    // The old blocks are released only once the new chain is built, so a
+    // write that runs out of space leaves the file as it was, and under
+    // dedup blocks the new contents still hold get linked again
+    uint32_t old_chain = entry->first_block;
+    if (size == 0) {
+        if (old_chain != FAT_EOC) fat_free_chain(old_chain);
+        entry->first_block = FAT_EOC;
+        entry->size = 0;
+        dir_set_modified(entry_idx);
+        fat_mark_entry(entry_idx);
+        return 0;
+    }
+    
+    // A compressed file's blocks hold its framed stream instead
+    const char *bytes = data;
+    size_t nbytes = size;
+    uint8_t *stream = NULL;
+    if (entry->flags & DIR_COMPRESSED) {
+        stream = fat_compress_stream(data, size, &nbytes);
+        if (!stream) return -1;
+        bytes = (const char *)stream;
+    }
+    
+    uint32_t first = dedup_enabled ? fat_write_dedup(bytes, nbytes) : fat_write_extents(bytes, nbytes);
+    free(stream);
+    if (first == FAT_EOC) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (old_chain != FAT_EOC) fat_free_chain(old_chain);
+    
+    entry->first_block = first;
+    entry->size = size;
+    dir_set_modified(entry_idx);
+    fat_mark_entry(entry_idx);
+    return 0;
+}
+
+// Compressed files have no fixed byte-to-block mapping and shared blocks
+// must not be patched in place, so partial updates to either decode the
+// whole file, patch it and write it back
+int fat_rewrite_file(uint32_t entry_idx, size_t offset, const char *data, size_t len, size_t new_size) {
+    size_t old_size = fs->dir_entries[entry_idx].size;
+    char *buf = calloc(1, new_size ? new_size : 1);
+    fat_file *f = fat_open(entry_idx);
+    if (!buf || !f) {
+        free(buf);
+        if (f) fat_close(f);
+        return -1;
+    }
+    
+    size_t keep = (old_size < new_size) ? old_size : new_size;
+    size_t got = fat_read(f, buf, keep);
+    fat_close(f);
+    if (got != keep) {
+        free(buf);
+        errno = EIO;
+        return -1;
+    }
+    if (len) memcpy(buf + offset, data, len);
+    
+    int rc = fat_write_file(entry_idx, buf, new_size);
+    free(buf);
+    return rc;
+}
+
+// True if any of the first limit blocks of the chain also belongs to
+// another file. Only the block where two chains join is counted, so a block
+// is shared when it or any block before it is.
+int fat_chain_shared(uint32_t block, uint32_t limit) {
+    if (block_shares_total == 0) return 0;
+    uint32_t steps = 0;
+    for (; block < fs->block_count && steps < limit && steps++ < fs->block_count; block = fs->fat_table[block]) {
+        if (block_shares[block] > 0) return 1;
+    }
+    return 0;
+}
+
+// File the blocks of a chain from index from onward under their current
+// content and successor, after a write in place changed them
+void dedup_reindex(uint32_t block, size_t from) {
+    uint32_t steps = 0;
+    for (; block < fs->block_count && steps++ < fs->block_count; block = fs->fat_table[block]) {
+        if (steps <= from) continue;
+        dedup_remove(block);
+        dedup_insert(block);
+    }
+}
+
+// Write len bytes at offset without touching the rest of the file. Blocks
+// are only added at the tail of the chain; new blocks the write does not
+// fully cover are zeroed so a gap past the old end reads as zeros.
+int fat_pwrite(uint32_t entry_idx, size_t offset, const char *data, size_t len) {
+    if (entry_idx >= fs->sb->num_entries || !fs->dir_entries[entry_idx].is_used) {
+        return -1;
+    }
+    
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    if (entry->is_dir) return -1;
+    if (len == 0) return 0;
+    if (offset + len > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    
+    // The write reaches the tail, whose link or slack it changes, only when
+    // it ends past the old size
+    uint32_t touched = (offset + len > entry->size) ? UINT32_MAX : (offset + len - 1) / fs->block_size + 1;
+    if ((entry->flags & DIR_COMPRESSED) || fat_chain_shared(entry->first_block, touched)) {
+        size_t end = (offset + len > entry->size) ? offset + len : entry->size;
+        return fat_rewrite_file(entry_idx, offset, data, len, end);
+    }
+    
+    size_t block_size = fs->block_size;
+    size_t end = offset + len;
+    size_t have = (entry->size + block_size - 1) / block_size;
+    size_t need = (end + block_size - 1) / block_size;
+    
+    // Find the tail, then grow the chain from there
+    uint32_t tail = FAT_EOC, tail_idx = 0;
+    if (need > have) {
+        for (uint32_t b = entry->first_block; b < fs->block_count && tail_idx < have; b = fs->fat_table[b]) {
+            tail = b;
+            tail_idx++;
+        }
+        
+        uint32_t added = FAT_EOC, prev = tail;
+        size_t missing = need - have;
+        size_t index = have;
+        while (missing > 0) {
+            uint32_t got;
+            uint32_t block = fat_alloc_extent(missing, &got);
+            if (block == FAT_EOC) {
+                if (added != FAT_EOC) fat_free_chain(added);
+                if (tail != FAT_EOC) {
+                    fat_set_next(tail, FAT_EOC);
+                } else {
+                    entry->first_block = FAT_EOC;
+                }
+                errno = ENOSPC;
+                return -1;
+            }
+            if (added == FAT_EOC) added = block;
+            if (prev == FAT_EOC) {
+                entry->first_block = block;
+            } else {
+                fat_set_next(prev, block);
+            }
+            
+            for (uint32_t i = 0; i < got; i++, index++) {
+                if (offset > index * block_size || end < (index + 1) * block_size) {
+                    memset(fat_block(block + i), 0, block_size);
+                    fat_mark_block(block + i);
+                }
+            }
+            prev = block + got - 1;
+            missing -= got;
+        }
+        
+        // Start the walk at the old tail when the write begins there
+        if (tail != FAT_EOC && offset / block_size < tail_idx - 1) tail = FAT_EOC;
+    }
+    
+    uint32_t current, index;
+    if (tail != FAT_EOC) {
+        current = tail;
+        index = tail_idx - 1;
+    } else {
+        current = entry->first_block;
+        index = 0;
+    }
+    while (index < offset / block_size) {
+        current = fs->fat_table[current];
+        index++;
+    }
+    
+    size_t done = 0;
+    size_t in_block = offset % block_size;
+    while (done < len) {
+        size_t to_copy = block_size - in_block;
+        if (to_copy > len - done) to_copy = len - done;
+        memcpy(fat_block(current) + in_block, data + done, to_copy);
+        fat_mark_dirty(fat_block(current) + in_block, to_copy);
+        done += to_copy;
+        in_block = 0;
+        if (done < len) current = fs->fat_table[current];
+    }
+    
+    // Appended blocks and the old tail's new link are searchable for dedup
+    // like the blocks of a whole-file write
+    if (dedup_next) {
+        size_t from = offset / block_size;
+        if (need > have && have > 0 && have - 1 < from) from = have - 1;
+        dedup_reindex(entry->first_block, from);
+    }
+    
+    if (end > entry->size) entry->size = end;
+    dir_set_modified(entry_idx);
+    fat_mark_entry(entry_idx);
+    return 0;
+}
+
+int fat_append(uint32_t entry_idx, const char *data, size_t len) {
+    if (entry_idx >= fs->sb->num_entries || !fs->dir_entries[entry_idx].is_used) {
+        return -1;
+    }
+    return fat_pwrite(entry_idx, fs->dir_entries[entry_idx].size, data, len);
+}
+
+// Shrink a file to size, releasing whole blocks past the new end and
+// zeroing the rest of the new last block
+int fat_truncate(uint32_t entry_idx, size_t size) {
+    if (entry_idx >= fs->sb->num_entries || !fs->dir_entries[entry_idx].is_used) {
+        return -1;
+    }
+    
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    if (entry->is_dir) return -1;
+    if (size >= entry->size) return 0;
+    uint32_t keep_blocks = (size + fs->block_size - 1) / fs->block_size;
+    if ((entry->flags & DIR_COMPRESSED) || fat_chain_shared(entry->first_block, keep_blocks)) {
+        return fat_rewrite_file(entry_idx, 0, NULL, 0, size);
+    }
+    
+    size_t block_size = fs->block_size;
+    size_t keep = (size + block_size - 1) / block_size;
+    if (keep == 0) {
+        fat_free_chain(entry->first_block);
+        entry->first_block = FAT_EOC;
+    } else {
+        uint32_t last = entry->first_block;
+        for (size_t i = 1; i < keep; i++) last = fs->fat_table[last];
+        
+        if (fs->fat_table[last] != FAT_EOC) {
+            fat_free_chain(fs->fat_table[last]);
+            fat_set_next(last, FAT_EOC);
+        }
+        if (size % block_size) {
+            memset(fat_block(last) + size % block_size, 0, block_size - size % block_size);
+            fat_mark_block(last);
+        }
+        if (dedup_next) dedup_reindex(last, 0);
+    }
+    
+    entry->size = size;
+    dir_set_modified(entry_idx);
+    fat_mark_entry(entry_idx);
+    return 0;
+}
+
+// Length of the prefix of data that the file already holds
+size_t fat_common_prefix(uint32_t entry_idx, const char *data, size_t len) {
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    if (entry->flags & DIR_COMPRESSED) return 0;
+    size_t limit = (entry->size < len) ? entry->size : len;
+    size_t block_size = fs->block_size;
+    size_t offset = 0;
+    
+    for (uint32_t b = entry->first_block; b < fs->block_count && offset < limit; b = fs->fat_table[b]) {
+        size_t n = (limit - offset > block_size) ? block_size : (limit - offset);
+        const uint8_t *blk = fat_block(b);
+        if (memcmp(blk, data + offset, n) != 0) {
+            while (blk[0] == (uint8_t)data[offset]) {
+                blk++;
+                offset++;
+            }
+            return offset;
+        }
+        offset += n;
+    }
+    return offset;
+}
+
+char* fat_read_file(uint32_t entry_idx) {
+    if (entry_idx >= fs->sb->num_entries || !fs->dir_entries[entry_idx].is_used) {
+        return NULL;
+    }
+    
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    if (entry->is_dir) return NULL;
+    
+    char *data = malloc(entry->size + 1);
+    fat_file *f = fat_open(entry_idx);
+    if (!data || !f) {
+        free(data);
+        if (f) fat_close(f);
+        return NULL;
+    }
+    
+    size_t got = fat_read(f, data, entry->size);
+    fat_close(f);
+    if (got != entry->size) {
+        free(data);
+        return NULL;
+    }
+    data[entry->size] = '\0';
+    return data;
+}
+
+void fat_ls(const char *path) {
+    uint32_t dir_idx = path ? fat_resolve_path(path) : fs->current_dir;
+    
+    if (dir_idx == (uint32_t)-1) {
+        fprintf(stderr, "ls: no such directory: %s\n", path ? path : "");
+        return;
+    }
+    
+    if (!fs->dir_entries[dir_idx].is_dir) {
+        printf("%s\n", fs->dir_names[dir_idx].name);
+        fflush(stdout);
+        return;
+    }
+    
+    // List all entries in this directory - one per line
+    for (uint32_t i = fs->dir_entries[dir_idx].first_child; i != (uint32_t)-1;
+         i = fs->dir_entries[i].next_sibling) {
+        printf("%s%s\n", 
+               fs->dir_names[i].name,
+               fs->dir_entries[i].is_dir ? "/" : "");
+        fflush(stdout);  // Flush after each line
+    }
+}
+
+void fat_cat(const char *path) {
+    uint32_t entry_idx = fat_resolve_path(path);
+    
+    if (entry_idx == (uint32_t)-1) {
+        fprintf(stderr, "cat: no such file: %s\n", path ? path : "");
+        return;
+    }
+    
+    if (fs->dir_entries[entry_idx].is_dir) {
+        fprintf(stderr, "cat: is a directory: %s\n", path);
+        return;
+    }
+    
+    fat_file *f = fat_open(entry_idx);
+    if (!f) return;
+    
+    const char *span;
+    size_t n;
+    while ((n = fat_span(f, &span, SIZE_MAX)) > 0) {
+        fwrite(span, 1, n, stdout);
+    }
+    fat_close(f);
+}
+
+int fat_cd(const char *path) {
+    if (!path) {
+        fs->current_dir = 0;
+        cwd_invalidate();
+        return 0;
+    }
+    
+    uint32_t dir_idx = fat_resolve_path(path);
+    if (dir_idx == (uint32_t)-1) {
+        errno = ENOENT;
+        return -1;
+    }
+    
+    if (!fs->dir_entries[dir_idx].is_dir) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    
+    fs->current_dir = dir_idx;
+    cwd_invalidate();
+    return 0;
+}
+
+// Build the absolute path of an entry in buf, right to left in one walk up
+// the parents
+char *fat_entry_path(uint32_t idx, char *buf, size_t size) {
+    char *p = buf + size - 1;
+    *p = '\0';
+    for (; idx != 0; idx = fs->dir_entries[idx].parent_entry) {
+        const char *name = fs->dir_names[idx].name;
+        size_t len = strlen(name);
+        if ((size_t)(p - buf) < len + 1) break;  // Deeper than the buffer
+        p -= len;
+        memcpy(p, name, len);
+        *--p = '/';
+    }
+    if (*p == '\0') *--p = '/';
+    
+    memmove(buf, p, strlen(p) + 1);
+    return buf;
+}
+
+const char *fat_cwd_path() {
+    if (cwd_path_valid) return cwd_path;
+    fat_entry_path(fs->current_dir, cwd_path, sizeof(cwd_path));
+    cwd_path_valid = 1;
+    return cwd_path;
+}
+
+void fat_pwd() {
+    printf("%s\n", fat_cwd_path());
+}
+
+// Bring the VFS copy of path in line with the real file. Only the part that
+// changed is written: appended bytes for >> redirection, otherwise
+// everything after the longest common prefix.
+void fat_sync_from_real_file(const char *path, int append) {
+    char realfile[PATH_MAX];
+    snprintf(realfile, sizeof(realfile), "%s/%s", ROOT_PATH, path);
+    
+    // Check if file exists on disk
+    if (access(realfile, F_OK) != 0) {
+        return;
+    }
+    
+    uint32_t entry_idx = fat_resolve_path(path);
+    
+    // If file doesn't exist in VFS, create it
+    if (entry_idx == (uint32_t)-1) {
+        printf("[VFS] Auto-creating '%s' in virtual file system\n", path);
+        if (fat_touch(path) < 0) {
+            fprintf(stderr, "[VFS] Failed to create '%s' in virtual file system\n", path);
+            return;
+        }
+        entry_idx = fat_resolve_path(path);
+        if (entry_idx == (uint32_t)-1) return;
+    }
+    
+    if (fs->dir_entries[entry_idx].is_dir) {
+        return;
+    }
+    
+    FILE *fp = fopen(realfile, "r");
+    if (!fp) return;
+    
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    long old_size = fs->dir_entries[entry_idx].size;
+    
+    if (size <= 0) {
+        fclose(fp);
+        fat_truncate(entry_idx, 0);
+        return;
+    }
+    
+    rewind(fp);
+    char *buf = malloc(size);
+    if (!buf) {
+        fclose(fp);
+        fprintf(stderr, "[VFS] Failed to sync '%s': %s\n", path, strerror(ENOMEM));
+        return;
+    }
+    size_t got = fread(buf, 1, size, fp);
+    fclose(fp);
+    
+    // Appended output: add only the new tail, provided the real file still
+    // starts with the VFS copy (an outside edit or a rollback may change it)
+    if (append && got >= (size_t)old_size && fat_common_prefix(entry_idx, buf, old_size) == (size_t)old_size) {
+        long added = got - old_size;
+        if (added > 0 && fat_append(entry_idx, buf + old_size, added) < 0) {
+            fprintf(stderr, "[VFS] Failed to sync '%s': %s\n", path, strerror(errno));
+        }
+        free(buf);
+        printf("[VFS] Synced '%s' to virtual file system (%ld bytes appended)\n", path, added);
+        return;
+    }
+    
+    if ((fs->dir_entries[entry_idx].flags & DIR_COMPRESSED) || dedup_enabled) {
+        // The chain is rebuilt anyway; skip the compare-and-patch
+        if (fat_write_file(entry_idx, buf, got) < 0) {
+            fprintf(stderr, "[VFS] Failed to sync '%s': %s\n", path, strerror(errno));
+        }
+    } else {
+        size_t same = fat_common_prefix(entry_idx, buf, got);
+        if (fat_pwrite(entry_idx, same, buf + same, got - same) < 0) {
+            fprintf(stderr, "[VFS] Failed to sync '%s': %s\n", path, strerror(errno));
+        } else {
+            fat_truncate(entry_idx, got);
+        }
+    }
+    free(buf);
+    printf("[VFS] Synced '%s' to virtual file system (%ld bytes)\n", path, size);
+}
+
+// The other direction: overwrite the real copy of a VFS file with the VFS
+// contents. Unless create is set, a file that only lives in the VFS stays
+// there.
+void fat_sync_to_real_file(uint32_t entry_idx, int create) {
+    char path[PATH_MAX], realfile[PATH_MAX * 2];
+    fat_entry_path(entry_idx, path, sizeof(path));
+    snprintf(realfile, sizeof(realfile), "%s%s", ROOT_PATH, path);
+    
+    fat_file *f = fat_open(entry_idx);
+    if (!f) return;
+    int fd = open(realfile, O_WRONLY | O_TRUNC | (create ? O_CREAT : 0), 0644);
+    if (fd >= 0) {
+        const char *span;
+        size_t n;
+        off_t offset = 0;
+        while ((n = fat_span(f, &span, SIZE_MAX)) > 0 && pwrite_full(fd, span, n, offset) == 0) {
+            offset += n;
+        }
+        close(fd);
+    }
+    fat_close(f);
+}
+
+/* ---------- Shell builtins ---------- */
+int is_shell_builtin(const char *cmd) {
+    return (strcmp(cmd, "cd") == 0 || strcmp(cmd, "exit") == 0 || 
+            strcmp(cmd, "history") == 0 || strcmp(cmd, "jobs") == 0 ||
+            strcmp(cmd, "ls") == 0 || strcmp(cmd, "cat") == 0 ||
+            strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "touch") == 0 ||
+            strcmp(cmd, "pwd") == 0 || strcmp(cmd, "grep") == 0 ||
+            strcmp(cmd, "rm") == 0 || strcmp(cmd, "rmdir") == 0 ||
+            strcmp(cmd, "head") == 0 || strcmp(cmd, "tail") == 0 ||
+            strcmp(cmd, "mv") == 0 || strcmp(cmd, "compress") == 0 ||
+            strcmp(cmd, "snapshot") == 0 || strcmp(cmd, "snapshots") == 0 ||
+            strcmp(cmd, "rollback") == 0 || strcmp(cmd, "fsck") == 0 ||
+            strcmp(cmd, "defrag") == 0 || strcmp(cmd, "wc") == 0);
+}
+
+// Builtins that change the file system. Every command of a pipeline runs
+// in a forked child, which must not change the image (see fs_owner), so a
+// pipeline naming one of these is refused before anything runs.
+int is_state_builtin(const char *cmd) {
+    return (strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "touch") == 0 ||
+            strcmp(cmd, "rm") == 0 || strcmp(cmd, "rmdir") == 0 ||
+            strcmp(cmd, "mv") == 0 || strcmp(cmd, "compress") == 0 ||
+            strcmp(cmd, "snapshot") == 0 || strcmp(cmd, "rollback") == 0 ||
+            strcmp(cmd, "defrag") == 0 || strcmp(cmd, "fsck") == 0);
+}
+
+int fat_mv(const char *source, const char *dest) {
+    if (!source || !dest) {
+        fprintf(stderr, "mv: missing operand\n");
+        return -1;
+    }
+    
+    // Find source entry
+    uint32_t src_idx = fat_resolve_path(source);
+    if (src_idx == (uint32_t)-1) {
+        fprintf(stderr, "mv: cannot stat '%s': No such file or directory\n", source);
+        return -1;
+    }
+    
+    // Cannot move root
+    if (src_idx == 0) {
+        fprintf(stderr, "mv: cannot move root directory\n");
+        return -1;
+    }
+    
+    dir_entry *src_entry = &fs->dir_entries[src_idx];
+    
+    // Parse destination path
+    char *dest_copy = strdup(dest);
+    char *last_slash = strrchr(dest_copy, '/');
+    char *new_name;
     uint32_t dest_parent_idx;
     
     if (!last_slash) {
@@ -681,236 +3078,1800 @@ int fat_mv(const char *source, const char *dest) {
         }
     }
     
-    // Check if destination parent is a directory
-    if (!fs->dir_entries[dest_parent_idx].is_dir) {
-        fprintf(stderr, "mv: cannot move to '%s': Not a directory\n", dest);
-        free(dest_copy);
+    // Check if destination parent is a directory
+    if (!fs->dir_entries[dest_parent_idx].is_dir) {
+        fprintf(stderr, "mv: cannot move to '%s': Not a directory\n", dest);
+        free(dest_copy);
+        return -1;
+    }
+    
+    // Check if destination already exists
+    uint32_t existing = fat_find_entry(new_name, dest_parent_idx);
+    if (existing != (uint32_t)-1) {
+        // If destination exists and is a directory, move source into it
+        if (fs->dir_entries[existing].is_dir) {
+            dest_parent_idx = existing;
+            new_name = fs->dir_names[src_idx].name;
+            
+            // Check again if it exists in the destination directory
+            uint32_t existing2 = fat_find_entry(new_name, dest_parent_idx);
+            if (existing2 != (uint32_t)-1) {
+                fprintf(stderr, "mv: cannot move '%s' to '%s': File exists\n", source, dest);
+                free(dest_copy);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "mv: cannot move '%s' to '%s': File exists\n", source, dest);
+            free(dest_copy);
+            return -1;
+        }
+    }
+    
+    // Perform the move - update parent and name
+    dir_index_remove(src_idx);
+    dcache_invalidate();
+    if (src_entry->parent_entry != dest_parent_idx) dir_unlink_child(src_idx);
+    uint32_t old_parent = src_entry->parent_entry;
+    src_entry->parent_entry = dest_parent_idx;
+    if (new_name != fs->dir_names[src_idx].name) dir_set_name(src_idx, new_name);
+    dir_set_modified(src_idx);
+    if (src_entry->is_dir) cwd_invalidate();  // It may be an ancestor of the cwd
+    fat_mark_entry(src_idx);
+    dir_index_insert(src_idx);
+    if (old_parent != dest_parent_idx) dir_link_child(src_idx);
+    
+    // Try to move real file/directory if it exists
+    char real_src[PATH_MAX], real_dest[PATH_MAX];
+    snprintf(real_src, sizeof(real_src), "%s/%s", ROOT_PATH, source);
+    snprintf(real_dest, sizeof(real_dest), "%s/%s", ROOT_PATH, dest);
+    rename(real_src, real_dest);  // Ignore errors if files don't exist
+    
+    printf("Moved '%s' to '%s'\n", source, dest);
+    free(dest_copy);
+    
+    return 0;
+}
+
+/* ---------- Line Index ---------- */
+// block_lines[] holds the newlines of every block, so the lines of a plain
+// file are counted by walking its chain without reading its data; only the
+// last block, whose tail past the size is stale, is scanned. The counts are
+// refreshed at commit, so a block written since then is scanned as well.
+// Compressed files hold no text in their blocks and are not indexed.
+
+int fat_block_dirty(uint32_t b) {
+    uint64_t g = (fs->sb->blocks_offset + (uint64_t)b * fs->block_size) / DIRTY_GRAIN, run;
+    return fat_next_run(dirty_map, &g, &run, g + fs->block_size / DIRTY_GRAIN);
+}
+
+// Newlines in the first len bytes of block b
+uint32_t fat_block_lines(uint32_t b, size_t len) {
+    if (len == fs->block_size && !fat_block_dirty(b)) return fs->block_lines[b];
+    return count_newlines(fat_block(b), len);
+}
+
+// Count the newlines of a plain file and report its last byte ('\n' when
+// empty). Returns -1 for a compressed file or a chain shorter than its size.
+long fat_count_newlines(uint32_t entry_idx, char *last) {
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    size_t left = entry->size;
+    long count = 0;
+    *last = '\n';
+    if (entry->flags & DIR_COMPRESSED) return -1;
+    
+    for (uint32_t b = entry->first_block; left > 0; b = fs->fat_table[b]) {
+        if (b >= fs->block_count) return -1;
+        size_t len = (left < fs->block_size) ? left : fs->block_size;
+        count += fat_block_lines(b, len);
+        left -= len;
+        if (left == 0) *last = (char)fat_block(b)[len - 1];
+    }
+    return count;
+}
+
+// File offset just past the nth newline (n >= 1) of a plain file, found by
+// skipping whole blocks on their counts. Returns -1 if there is no such line.
+long fat_newline_offset(uint32_t entry_idx, long n) {
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    size_t left = entry->size, pos = 0;
+    
+    for (uint32_t b = entry->first_block; left > 0 && b < fs->block_count; b = fs->fat_table[b]) {
+        size_t len = (left < fs->block_size) ? left : fs->block_size;
+        uint32_t lines = fat_block_lines(b, len);
+        if (lines < n) {
+            n -= lines;
+            pos += len;
+            left -= len;
+            continue;
+        }
+        const char *data = (const char *)fat_block(b), *p = data;
+        while ((p = memchr(p, '\n', data + len - p)) != NULL && --n > 0) p++;
+        return p ? (long)(pos + (p - data) + 1) : -1;
+    }
+    return -1;
+}
+
+void fat_head(int num_lines, const char *filename) {
+    if (!filename) {
+        fprintf(stderr, "head: missing file operand\n");
+        return;
+    }
+    
+    uint32_t entry_idx = fat_resolve_path(filename);
+    if (entry_idx == (uint32_t)-1) {
+        fprintf(stderr, "head: %s: No such file\n", filename);
+        return;
+    }
+    
+    if (fs->dir_entries[entry_idx].is_dir) {
+        fprintf(stderr, "head: %s: Is a directory\n", filename);
+        return;
+    }
+    
+    fat_file *f = fat_open(entry_idx);
+    if (!f) return;
+    
+    // Print through the Nth newline straight from the file's blocks
+    const char *span;
+    size_t n;
+    int count = 0;
+    char last = '\n';
+    while (count < num_lines && (n = fat_span(f, &span, SIZE_MAX)) > 0) {
+        const char *p = span, *end = span + n;
+        while (p < end && count < num_lines) {
+            const char *nl = memchr(p, '\n', end - p);
+            const char *stop = nl ? nl + 1 : end;
+            fwrite(p, 1, stop - p, stdout);
+            last = stop[-1];
+            if (nl) count++;
+            p = stop;
+        }
+    }
+    if (last != '\n') putchar('\n');
+    fat_close(f);
+}
+
+void fat_tail(int num_lines, const char *filename) {
+    if (!filename) {
+        fprintf(stderr, "tail: missing file operand\n");
+        return;
+    }
+    
+    uint32_t entry_idx = fat_resolve_path(filename);
+    if (entry_idx == (uint32_t)-1) {
+        fprintf(stderr, "tail: %s: No such file\n", filename);
+        return;
+    }
+    
+    if (fs->dir_entries[entry_idx].is_dir) {
+        fprintf(stderr, "tail: %s: Is a directory\n", filename);
+        return;
+    }
+    
+    fat_file *f = fat_open(entry_idx);
+    if (!f) return;
+    
+    // Count lines (a final line without a newline still counts) from the
+    // line index; a compressed file takes a first pass over its text instead
+    const char *span;
+    size_t n;
+    char last;
+    long total_lines = fat_count_newlines(entry_idx, &last);
+    int indexed = (total_lines >= 0);
+    if (!indexed) {
+        total_lines = 0;
+        last = '\n';
+        while ((n = fat_span(f, &span, SIZE_MAX)) > 0) {
+            total_lines += count_newlines(span, n);
+            last = span[n - 1];
+        }
+    }
+    if (last != '\n') total_lines++;
+    
+    // Go to the first line to print, then copy the rest. With the index the
+    // blocks before it are never read; otherwise the lines are skipped.
+    long skip = (total_lines > num_lines) ? (total_lines - num_lines) : 0;
+    long start = (indexed && skip > 0) ? fat_newline_offset(entry_idx, skip) : -1;
+    if (start >= 0) skip = 0;
+    fat_seek(f, (start > 0) ? start : 0, SEEK_SET);
+    while ((n = fat_span(f, &span, SIZE_MAX)) > 0) {
+        const char *p = span, *end = span + n;
+        while (skip > 0 && p < end) {
+            const char *nl = memchr(p, '\n', end - p);
+            if (!nl) {
+                p = end;
+                break;
+            }
+            p = nl + 1;
+            skip--;
+        }
+        fwrite(p, 1, end - p, stdout);
+    }
+    if (last != '\n') putchar('\n');
+    fat_close(f);
+}
+
+// What wc prints. Lines come from the line index and bytes from the entry,
+// so a file is only read for its words or when it is compressed.
+#define WC_LINES 0x01
+#define WC_WORDS 0x02
+#define WC_BYTES 0x04
+
+void wc_words(const char *p, size_t n, long *words, int *in_word) {
+    for (const char *end = p + n; p < end; p++) {
+        int space = isspace((unsigned char)*p);
+        if (!space && !*in_word) (*words)++;
+        *in_word = !space;
+    }
+}
+
+void fat_wc(int what, const char *filename) {
+    long lines = 0, words = 0, bytes = 0;
+    int in_word = 0;
+    
+    // If reading from stdin (no filename or filename is "-"). The fd is read
+    // directly: in a pipeline the stdin FILE buffer still holds the rest of
+    // the script the shell was reading when it forked.
+    if (!filename || strcmp(filename, "-") == 0) {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "wc: %s\n", strerror(errno));
+                return;
+            }
+            lines += count_newlines(buf, n);
+            wc_words(buf, n, &words, &in_word);
+            bytes += n;
+        }
+    } else {
+        uint32_t entry_idx = fat_resolve_path(filename);
+        if (entry_idx == (uint32_t)-1) {
+            fprintf(stderr, "wc: %s: No such file\n", filename);
+            return;
+        }
+        if (fs->dir_entries[entry_idx].is_dir) {
+            fprintf(stderr, "wc: %s: Is a directory\n", filename);
+            return;
+        }
+        
+        char last;
+        bytes = fs->dir_entries[entry_idx].size;
+        lines = (what & WC_LINES) ? fat_count_newlines(entry_idx, &last) : 0;
+        if (lines < 0 || (what & WC_WORDS)) {
+            fat_file *f = fat_open(entry_idx);
+            if (!f) return;
+            int indexed = (lines >= 0);
+            const char *span;
+            size_t n;
+            if (!indexed) lines = 0;
+            while ((n = fat_span(f, &span, SIZE_MAX)) > 0) {
+                if (!indexed) lines += count_newlines(span, n);
+                wc_words(span, n, &words, &in_word);
+            }
+            fat_close(f);
+        }
+    }
+    
+    const char *sep = "";
+    if (what & WC_LINES) {
+        printf("%ld", lines);
+        sep = " ";
+    }
+    if (what & WC_WORDS) {
+        printf("%s%ld", sep, words);
+        sep = " ";
+    }
+    if (what & WC_BYTES) printf("%s%ld", sep, bytes);
+    if (filename && strcmp(filename, "-") != 0) printf(" %s", filename);
+    putchar('\n');
+}
+
+int fat_rmdir(const char *path) {
+    if (!path) {
+        fprintf(stderr, "rmdir: missing operand\n");
+        return -1;
+    }
+    
+    uint32_t entry_idx = fat_resolve_path(path);
+    if (entry_idx == (uint32_t)-1) {
+        fprintf(stderr, "rmdir: failed to remove '%s': No such file or directory\n", path);
+        return -1;
+    }
+    
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    
+    // Must be a directory
+    if (!entry->is_dir) {
+        fprintf(stderr, "rmdir: failed to remove '%s': Not a directory\n", path);
+        return -1;
+    }
+    
+    // Cannot remove root directory
+    if (entry_idx == 0) {
+        fprintf(stderr, "rmdir: failed to remove '/': Cannot remove root directory\n");
+        return -1;
+    }
+    
+    // Check if directory is empty (no children)
+    if (entry->first_child != (uint32_t)-1) {
+        fprintf(stderr, "rmdir: failed to remove '%s': Directory not empty\n", path);
+        return -1;
+    }
+    
+    // Cannot remove current directory
+    if (entry_idx == fs->current_dir) {
+        fprintf(stderr, "rmdir: failed to remove '%s': Cannot remove current directory\n", path);
+        return -1;
+    }
+    
+    // Mark entry as unused
+    dir_index_remove(entry_idx);
+    dir_unlink_child(entry_idx);
+    dcache_invalidate();
+    entry->is_used = 0;
+    fat_mark_entry(entry_idx);
+    fat_release_entry(entry_idx);
+    
+    // Try to remove real directory if it exists
+    char realdir[PATH_MAX];
+    snprintf(realdir, sizeof(realdir), "%s/%s", ROOT_PATH, path);
+    rmdir(realdir);  // Ignore errors if directory doesn't exist
+    
+    printf("Removed directory '%s' from virtual file system\n", path);
+    
+    return 0;
+}
+
+int fat_rm(const char *path) {
+    if (!path) {
+        fprintf(stderr, "rm: missing operand\n");
+        return -1;
+    }
+    
+    uint32_t entry_idx = fat_resolve_path(path);
+    if (entry_idx == (uint32_t)-1) {
+        fprintf(stderr, "rm: cannot remove '%s': No such file or directory\n", path);
+        return -1;
+    }
+    
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    
+    // Don't allow removing directories (use rmdir for that)
+    if (entry->is_dir) {
+        fprintf(stderr, "rm: cannot remove '%s': Is a directory\n", path);
+        return -1;
+    }
+    
+    // Free the blocks used by this file
+    if (entry->first_block != FAT_EOC) {
+        fat_free_chain(entry->first_block);
+    }
+    
+    // Mark entry as unused
+    dir_index_remove(entry_idx);
+    dir_unlink_child(entry_idx);
+    dcache_invalidate();
+    entry->is_used = 0;
+    entry->first_block = FAT_EOC;
+    entry->size = 0;
+    fat_mark_entry(entry_idx);
+    fat_release_entry(entry_idx);
+    
+    // Try to remove the real file too (if it exists)
+    char realfile[PATH_MAX];
+    snprintf(realfile, sizeof(realfile), "%s/%s", ROOT_PATH, path);
+    unlink(realfile);  // Ignore errors if file doesn't exist
+    
+    printf("Removed '%s' from virtual file system\n", path);
+    
+    return 0;
+}
+
+// Switch a file between plain and compressed storage, rewriting its blocks
+int fat_compress(const char *path, int on) {
+    uint32_t entry_idx = fat_resolve_path(path);
+    if (entry_idx == (uint32_t)-1) {
+        fprintf(stderr, "compress: %s: No such file\n", path);
+        return -1;
+    }
+    
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    if (entry->is_dir) {
+        fprintf(stderr, "compress: %s: Is a directory\n", path);
+        return -1;
+    }
+    
+    if (!(entry->flags & DIR_COMPRESSED) != !on) {
+        char *data = fat_read_file(entry_idx);
+        if (!data) {
+            fprintf(stderr, "compress: %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        
+        uint8_t old_flags = entry->flags;
+        entry->flags = on ? (entry->flags | DIR_COMPRESSED) : (entry->flags & ~DIR_COMPRESSED);
+        if (fat_write_file(entry_idx, data, entry->size) < 0) {
+            fprintf(stderr, "compress: %s: %s\n", path, strerror(errno));
+            entry->flags = old_flags;
+            fat_mark_entry(entry_idx);
+            free(data);
+            return -1;
+        }
+        free(data);
+    }
+    
+    uint32_t blocks = 0;
+    for (uint32_t b = entry->first_block; b < fs->block_count && blocks < fs->block_count; b = fs->fat_table[b]) blocks++;
+    printf("%s: %u bytes in %u block%s%s\n", path, entry->size, blocks, blocks == 1 ? "" : "s",
+           (entry->flags & DIR_COMPRESSED) ? " (compressed)" : "");
+    return 0;
+}
+
+// Save the entry table and name pool under name. No data is copied: each
+// file's chain gains a reference, so later writes leave it untouched.
+int fat_snapshot(const char *name) {
+    if (!snapshot_valid_name(name)) {
+        fprintf(stderr, "snapshot: invalid name '%s'\n", name);
+        return -1;
+    }
+    char path[PATH_MAX + 80], tmppath[PATH_MAX + 96];
+    snapshot_path(path, sizeof(path), name);
+    snprintf(tmppath, sizeof(tmppath), "%s.new", path);
+    if (access(path, F_OK) == 0) {
+        fprintf(stderr, "snapshot: '%s' already exists\n", name);
+        return -1;
+    }
+    
+    // Blocks the snapshot names must be on disk before it is
+    if (fat_commit() < 0) {
+        fprintf(stderr, "snapshot: %s\n", strerror(errno));
+        return -1;
+    }
+    
+    uint32_t n = fs->sb->num_entries;
+    size_t len = sizeof(snapshot_header) + (size_t)n * (sizeof(dir_entry) + sizeof(dir_name));
+    uint8_t *buf = malloc(len);
+    if (!buf) return -1;
+    snapshot_header *hdr = (snapshot_header *)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = SNAPSHOT_MAGIC;
+    hdr->num_entries = n;
+    hdr->current_dir = fs->current_dir;
+    hdr->created = time(NULL);
+    hdr->volume_id = fs->sb->volume_id;
+    memcpy(buf + sizeof(*hdr), fs->dir_entries, n * sizeof(dir_entry));
+    memcpy(buf + sizeof(*hdr) + n * sizeof(dir_entry), fs->dir_names, n * sizeof(dir_name));
+    hdr->crc = crc32c(0, buf, len);
+    
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || pwrite_full(fd, buf, len, 0) < 0 || fdatasync(fd) < 0 ||
+        close(fd) < 0 || rename(tmppath, path) < 0) {
+        fprintf(stderr, "snapshot: %s\n", strerror(errno));
+        if (fd >= 0) unlink(tmppath);
+        free(buf);
+        return -1;
+    }
+    
+    snapshot_info *info = snapshot_add(name, buf);
+    if (!info) {
+        fprintf(stderr, "snapshot: %s\n", strerror(errno));
+        unlink(path);
+        free(buf);
+        return -1;
+    }
+    for (uint32_t f = 0; f < info->files; f++) {
+        block_shares[info->first_blocks[f]]++;
+        block_shares_total++;
+    }
+    free(buf);
+    printf("Snapshot '%s' saved (%u files)\n", name, info->files);
+    return 0;
+}
+
+void fat_snapshots() {
+    if (snapshot_count == 0) {
+        printf("No snapshots\n");
+        return;
+    }
+    for (uint32_t s = 0; s < snapshot_count; s++) {
+        char when[32];
+        time_t created = snapshots[s].created;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+        printf("%-20s %s  %u files\n", snapshots[s].name, when, snapshots[s].files);
+    }
+}
+
+// Mark every block reachable from the live files and the snapshots, then
+// free the rest
+void fat_sweep_blocks() {
+    uint64_t *reached = calloc((fs->block_count + 63) / 64, sizeof(uint64_t));
+    if (!reached) return;
+    
+    for (uint32_t i = 0; i <= snapshot_count; i++) {
+        uint32_t count = (i < snapshot_count) ? snapshots[i].files : fs->sb->num_entries;
+        for (uint32_t f = 0; f < count; f++) {
+            uint32_t b;
+            if (i < snapshot_count) {
+                b = snapshots[i].first_blocks[f];
+            } else {
+                dir_entry *entry = &fs->dir_entries[f];
+                if (!entry->is_used || entry->is_dir) continue;
+                b = entry->first_block;
+            }
+            // Stop at a block already reached: the rest of its chain was too
+            while (b < fs->block_count && !(reached[b / 64] & (1ULL << (b % 64)))) {
+                reached[b / 64] |= 1ULL << (b % 64);
+                b = fs->fat_table[b];
+            }
+        }
+    }
+    
+    for (uint32_t b = 0; b < fs->block_count; b++) {
+        if (fs->fat_table[b] == FAT_FREE || (reached[b / 64] & (1ULL << (b % 64)))) continue;
+        fat_set_next(b, FAT_FREE);
+        release_map[b / 64] |= 1ULL << (b % 64);
+        release_count++;
+    }
+    free(reached);
+    fat_rebuild_free_map();
+}
+
+int path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Replace the live entry table with a snapshot's. Blocks only the old live
+// files used are freed; the snapshot itself is kept.
+int fat_rollback(const char *name) {
+    char path[PATH_MAX + 80];
+    uint8_t *buf = NULL;
+    if (snapshot_valid_name(name)) {
+        snapshot_path(path, sizeof(path), name);
+        buf = snapshot_read(path);
+    }
+    if (!buf) {
+        fprintf(stderr, "rollback: %s: %s\n", name, errno == ENOENT ? "No such snapshot" :
+                errno == ESTALE ? "snapshot does not match this file system" : strerror(errno));
         return -1;
     }
     
-    // Check if destination already exists
-    uint32_t existing = fat_find_entry(new_name, dest_parent_idx);
-    if (existing != (uint32_t)-1) {
-        // If destination exists and is a directory, move source into it
-        if (fs->dir_entries[existing].is_dir) {
-            dest_parent_idx = existing;
-            new_name = src_entry->name;
-            
-            // Check again if it exists in the destination directory
-            uint32_t existing2 = fat_find_entry(new_name, dest_parent_idx);
-            if (existing2 != (uint32_t)-1) {
-                fprintf(stderr, "mv: cannot move '%s' to '%s': File exists\n", source, dest);
-                free(dest_copy);
-                return -1;
-            }
+    snapshot_header *hdr = (snapshot_header *)buf;
+    dir_entry *entries = (dir_entry *)(buf + sizeof(*hdr));
+    dir_name *names = (dir_name *)(entries + hdr->num_entries);
+    uint32_t n = hdr->num_entries;
+    int ok = (n <= fs->sb->max_entries);
+    for (uint32_t i = 0; ok && i < n; i++) {
+        if (entries[i].is_used && !entries[i].is_dir && entries[i].first_block != FAT_EOC) {
+            ok = entries[i].first_block < fs->block_count && fs->fat_table[entries[i].first_block] != FAT_FREE;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "rollback: %s: snapshot does not match this file system\n", name);
+        free(buf);
+        return -1;
+    }
+    
+    uint32_t old_n = fs->sb->num_entries;
+    uint32_t span = (old_n > n) ? old_n : n;
+    
+    // Note the files that exist now, so real copies of the ones the
+    // snapshot lacks can be removed afterwards
+    char **old_paths = malloc((old_n + 1) * sizeof(char *));
+    uint32_t old_files = 0;
+    for (uint32_t i = 0; old_paths && i < old_n; i++) {
+        if (fs->dir_entries[i].is_used && !fs->dir_entries[i].is_dir) {
+            char p[PATH_MAX];
+            char *copy = strdup(fat_entry_path(i, p, sizeof(p)));
+            if (copy) old_paths[old_files++] = copy;
+        }
+    }
+    if (old_files > 1) qsort(old_paths, old_files, sizeof(char *), path_cmp);
+    
+    memcpy(fs->dir_entries, entries, n * sizeof(dir_entry));
+    memcpy(fs->dir_names, names, n * sizeof(dir_name));
+    if (old_n > n) {
+        memset(&fs->dir_entries[n], 0, (old_n - n) * sizeof(dir_entry));
+        memset(&fs->dir_names[n], 0, (old_n - n) * sizeof(dir_name));
+    }
+    fs->sb->num_entries = n;
+    fs->current_dir = hdr->current_dir;
+    fat_mark_dirty(fs->dir_entries, span * sizeof(dir_entry));
+    fat_mark_dirty(fs->dir_names, span * sizeof(dir_name));
+    fat_mark_dirty(fs->sb, sizeof(fat_superblock));
+    free(buf);
+    
+    fat_sweep_blocks();
+    dir_index_rebuild();
+    dir_slots_rebuild();
+    dcache_invalidate();
+    cwd_invalidate();
+    
+    // Bring the real copies under OS_PROJECT in line, as rm and the
+    // redirections do, so none is synced back over the restored files.
+    // Files the rollback brings back get a real copy again (rm took theirs);
+    // the others are rewritten where they have one.
+    for (uint32_t i = 0; i < n; i++) {
+        if (!fs->dir_entries[i].is_used || fs->dir_entries[i].is_dir) continue;
+        char p[PATH_MAX];
+        char *key = fat_entry_path(i, p, sizeof(p));
+        int existed = bsearch(&key, old_paths, old_files, sizeof(char *), path_cmp) != NULL;
+        fat_sync_to_real_file(i, !existed);
+    }
+    for (uint32_t i = 0; i < old_files; i++) {
+        uint32_t idx = fat_resolve_path(old_paths[i]);
+        if (idx == (uint32_t)-1 || fs->dir_entries[idx].is_dir) {
+            char realfile[PATH_MAX * 2];
+            snprintf(realfile, sizeof(realfile), "%s%s", ROOT_PATH, old_paths[i]);
+            unlink(realfile);
+        }
+        free(old_paths[i]);
+    }
+    free(old_paths);
+    printf("Rolled back to snapshot '%s'\n", name);
+    return 0;
+}
+
+int fat_snapshot_delete(const char *name) {
+    char path[PATH_MAX + 80];
+    errno = ENOENT;
+    if (snapshot_valid_name(name)) snapshot_path(path, sizeof(path), name);
+    if (!snapshot_valid_name(name) || unlink(path) < 0) {
+        fprintf(stderr, "snapshot: %s: %s\n", name, errno == ENOENT ? "No such snapshot" : strerror(errno));
+        return -1;
+    }
+    
+    // Removed first, so a crash can only leak its blocks, never reuse them early
+    snapshots_scan();
+    fat_sweep_blocks();
+    printf("Deleted snapshot '%s'\n", name);
+    return 0;
+}
+
+/* ---------- Consistency Check ---------- */
+// fsck scans the FAT and the block checksums in parallel over block ranges,
+// then walks every chain from the entries and snapshots on one thread.
+#define FSCK_MAX_THREADS 8
+#define FSCK_BLOCKS_PER_THREAD 4096
+#define FSCK_REPORT_MAX 20
+
+#define FSCK_BAD_NEXT 0x01
+#define FSCK_BAD_SUM 0x02
+#define FSCK_BAD_LINES 0x04
+
+typedef struct {
+    uint32_t first, last;  // Blocks [first, last) this worker scans
+    int verify;            // Also compare each allocated block with its sum
+    uint8_t *problems;     // FSCK_* flags per block, written only in range
+    uint32_t free_blocks;
+} fsck_range;
+
+uint32_t fsck_problems = 0;
+int fsck_verbose = 0;
+
+void fsck_report(const char *fmt, ...) {
+    if (fsck_verbose && fsck_problems < FSCK_REPORT_MAX) {
+        va_list ap;
+        va_start(ap, fmt);
+        fprintf(stderr, "fsck: ");
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+        va_end(ap);
+    }
+    fsck_problems++;
+}
+
+void *fsck_scan_range(void *arg) {
+    fsck_range *r = arg;
+    for (uint32_t b = r->first; b < r->last; b++) {
+        uint32_t next = fs->fat_table[b];
+        if (next == FAT_FREE) {
+            r->free_blocks++;
+            continue;
+        }
+        if (next != FAT_EOC && next >= fs->block_count) r->problems[b] |= FSCK_BAD_NEXT;
+        if (r->verify && crc32c(0, fat_block(b), fs->block_size) != fs->block_sums[b]) {
+            r->problems[b] |= FSCK_BAD_SUM;
+        } else if (r->verify && count_newlines(fat_block(b), fs->block_size) != fs->block_lines[b]) {
+            r->problems[b] |= FSCK_BAD_LINES;
+        }
+    }
+    return NULL;
+}
+
+// Walk the chain at first, stamping its blocks with walk, and return its
+// length in blocks. tail_len[b] keeps the blocks left from b to the end, so
+// a chain that joins one already walked stops there; UINT32_MAX marks a
+// chain already reported as broken. Returns -1 if this chain is broken.
+long fsck_walk_chain(uint32_t first, uint32_t walk, uint32_t *stamp, uint32_t *tail_len, const char *owner) {
+    uint32_t len = 0, rest = 0, b = first;
+    int broken = 0;
+    while (b != FAT_EOC) {
+        if (b >= fs->block_count) {
+            fsck_report("%s: chain points past the last block (%u)", owner, b);
+            broken = 1;
+        } else if (fs->fat_table[b] == FAT_FREE) {
+            fsck_report("%s: chain runs into free block %u", owner, b);
+            broken = 1;
+        } else if (stamp[b] == walk) {
+            fsck_report("%s: chain loops back to block %u", owner, b);
+            broken = 1;
+        } else if (stamp[b] != 0) {
+            broken = (tail_len[b] == UINT32_MAX);
+            rest = tail_len[b];
+        }
+        if (broken || stamp[b] != 0) break;
+        stamp[b] = walk;
+        len++;
+        b = fs->fat_table[b];
+    }
+    
+    b = first;
+    for (uint32_t i = 0; i < len; i++, b = fs->fat_table[b]) {
+        tail_len[b] = broken ? UINT32_MAX : len + rest - i;
+    }
+    return broken ? -1 : (long)(len + rest);
+}
+
+// Check the image in memory and return the number of problems found.
+// verify adds a checksum comparison for every allocated block; verbose
+// reports each problem and a summary.
+uint32_t fat_check(int verify, int verbose) {
+    uint32_t n = fs->sb->num_entries;
+    uint8_t *problems = calloc(fs->block_count, 1);
+    uint32_t *stamp = calloc(fs->block_count, sizeof(uint32_t));
+    uint32_t *tail_len = calloc(fs->block_count, sizeof(uint32_t));
+    if (!problems || !stamp || !tail_len) {
+        free(problems);
+        free(stamp);
+        free(tail_len);
+        return 1;
+    }
+    fsck_problems = 0;
+    fsck_verbose = verbose;
+    crc32c(0, NULL, 0);  // Set up the table before the workers share it
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = (fs->block_count + FSCK_BLOCKS_PER_THREAD - 1) / FSCK_BLOCKS_PER_THREAD;
+    if (cpus > 0 && threads > (uint32_t)cpus) threads = cpus;
+    if (threads > FSCK_MAX_THREADS) threads = FSCK_MAX_THREADS;
+    if (threads == 0) threads = 1;
+    
+    fsck_range ranges[FSCK_MAX_THREADS];
+    pthread_t workers[FSCK_MAX_THREADS];
+    int started[FSCK_MAX_THREADS] = {0};
+    uint32_t per = (fs->block_count + threads - 1) / threads;
+    for (uint32_t t = 0; t < threads; t++) {
+        ranges[t].first = t * per;
+        ranges[t].last = (t + 1 == threads) ? fs->block_count : (t + 1) * per;
+        ranges[t].verify = verify;
+        ranges[t].problems = problems;
+        ranges[t].free_blocks = 0;
+        // The last range runs here, as does any range without a thread
+        if (t + 1 < threads) {
+            started[t] = (pthread_create(&workers[t], NULL, fsck_scan_range, &ranges[t]) == 0);
+        }
+    }
+    uint32_t free_blocks = 0;
+    for (uint32_t t = 0; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(workers[t], NULL);
         } else {
-            fprintf(stderr, "mv: cannot move '%s' to '%s': File exists\n", source, dest);
-            free(dest_copy);
-            return -1;
+            fsck_scan_range(&ranges[t]);
         }
+        free_blocks += ranges[t].free_blocks;
     }
     
-    // Perform the move - update parent and name
-    src_entry->parent_entry = dest_parent_idx;
-    strncpy(src_entry->name, new_name, MAX_FILENAME);
-    src_entry->modified = time(NULL);
+    for (uint32_t b = 0; b < fs->block_count; b++) {
+        if (problems[b] & FSCK_BAD_NEXT) {
+            fsck_report("block %u: next pointer %u is out of range", b, fs->fat_table[b]);
+        }
+        if (problems[b] & FSCK_BAD_SUM) fsck_report("block %u: checksum mismatch", b);
+        if (problems[b] & FSCK_BAD_LINES) fsck_report("block %u: stale newline count", b);
+    }
+    if (free_blocks != free_block_count + release_count) {
+        fsck_report("free map counts %u free blocks, the FAT %u", free_block_count + release_count, free_blocks);
+    }
     
-    // Try to move real file/directory if it exists
-    char real_src[PATH_MAX], real_dest[PATH_MAX];
-    snprintf(real_src, sizeof(real_src), "%s/%s", ROOT_PATH, source);
-    snprintf(real_dest, sizeof(real_dest), "%s/%s", ROOT_PATH, dest);
-    rename(real_src, real_dest);  // Ignore errors if files don't exist
+    uint32_t files = 0, dirs = 0, walk = 0;
+    char owner[MAX_FILENAME + 32];
+    if (!fs->dir_entries[0].is_used || !fs->dir_entries[0].is_dir) {
+        fsck_report("entry 0: root is not a directory");
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        dir_entry *entry = &fs->dir_entries[i];
+        if (!entry->is_used) continue;
+        snprintf(owner, sizeof(owner), "entry %u ('%.*s')", i, MAX_FILENAME, fs->dir_names[i].name);
+        
+        if (i != 0) {
+            uint32_t p = entry->parent_entry, steps = 0;
+            if (p >= n || !fs->dir_entries[p].is_used || !fs->dir_entries[p].is_dir) {
+                fsck_report("%s: parent %u is not a directory", owner, p);
+            } else {
+                while (p != 0 && p < n && steps++ < n) p = fs->dir_entries[p].parent_entry;
+                if (p != 0) fsck_report("%s: parent links never reach the root", owner);
+            }
+        }
+        
+        if (entry->is_dir) {
+            dirs++;
+            continue;
+        }
+        files++;
+        long blocks = fsck_walk_chain(entry->first_block, ++walk, stamp, tail_len, owner);
+        size_t need = ((size_t)entry->size + fs->block_size - 1) / fs->block_size;
+        if (blocks >= 0 && !(entry->flags & DIR_COMPRESSED) && (size_t)blocks != need) {
+            fsck_report("%s: %ld blocks hold %u bytes", owner, blocks, entry->size);
+        }
+    }
+    for (uint32_t s = 0; s < snapshot_count; s++) {
+        snprintf(owner, sizeof(owner), "snapshot '%s'", snapshots[s].name);
+        for (uint32_t f = 0; f < snapshots[s].files; f++) {
+            fsck_walk_chain(snapshots[s].first_blocks[f], ++walk, stamp, tail_len, owner);
+        }
+    }
     
-    printf("Moved '%s' to '%s'\n", source, dest);
-    free(dest_copy);
+    uint32_t orphans = 0, first_orphan = 0;
+    for (uint32_t b = 0; b < fs->block_count; b++) {
+        if (fs->fat_table[b] != FAT_FREE && stamp[b] == 0 && orphans++ == 0) first_orphan = b;
+    }
+    if (orphans > 0) {
+        fsck_report("%u allocated block%s in no file (first %u)",
+                    orphans, orphans == 1 ? "" : "s", first_orphan);
+    }
+    
+    if (verbose) {
+        if (fsck_problems > FSCK_REPORT_MAX) {
+            fprintf(stderr, "fsck: %u more problems not shown\n", fsck_problems - FSCK_REPORT_MAX);
+        }
+        printf("%u blocks, %u files, %u directories checked with %u thread%s: ",
+               fs->block_count, files, dirs, threads, threads == 1 ? "" : "s");
+        if (fsck_problems == 0) {
+            printf("clean\n");
+        } else {
+            printf("%u problem%s\n", fsck_problems, fsck_problems == 1 ? "" : "s");
+        }
+    }
+    free(problems);
+    free(stamp);
+    free(tail_len);
+    return fsck_problems;
+}
+
+int fat_fsck() {
+    // Bring the checksums up to date with everything already written
+    if (fat_commit() < 0) {
+        fprintf(stderr, "fsck: %s\n", strerror(errno));
+        return -1;
+    }
+    return fat_check(1, 1) == 0 ? 0 : -1;
+}
+
+/* ---------- Defragmentation ---------- */
+// defrag copies each fragmented chain into one free extent and frees the
+// old blocks. Every move is committed before the next, so the blocks a
+// move frees are released (see release_map) before the next one allocates.
+// MYSH_FS_DEFRAG=N moves up to N chains between commands.
+#define DEFRAG_SCAN_BATCH 64
+
+uint32_t defrag_batch = 0;
+uint32_t defrag_cursor = 0;  // Entry the next background step starts at
+
+// Number of contiguous runs in a chain; *blocks gets its length
+uint32_t fat_chain_extents(uint32_t block, uint32_t *blocks) {
+    uint32_t extents = 0;
+    *blocks = 0;
+    while (block < fs->block_count && *blocks < fs->block_count) {
+        uint32_t next = fs->fat_table[block];
+        (*blocks)++;
+        if (next != block + 1) extents++;
+        block = next;
+    }
+    return extents;
+}
+
+void fat_fragmentation(uint32_t *files, uint32_t *extents, uint32_t *fragmented) {
+    *files = *extents = *fragmented = 0;
+    for (uint32_t i = 0; i < fs->sb->num_entries; i++) {
+        dir_entry *entry = &fs->dir_entries[i];
+        if (!entry->is_used || entry->is_dir) continue;
+        uint32_t blocks;
+        uint32_t runs = fat_chain_extents(entry->first_block, &blocks);
+        (*files)++;
+        *extents += runs;
+        if (runs > 1) (*fragmented)++;
+    }
+}
+
+// Move a file's chain into one free extent. Returns 1 if it moved, 0 if it
+// was already contiguous, -1 if it is shared or no extent is large enough,
+// and -2 with errno set if the move could not be committed.
+int fat_defrag_file(uint32_t entry_idx, uint32_t *moved_blocks) {
+    dir_entry *entry = &fs->dir_entries[entry_idx];
+    if (!entry->is_used || entry->is_dir) return 0;
+    uint32_t blocks;
+    if (fat_chain_extents(entry->first_block, &blocks) <= 1) return 0;
+    
+    // Other chains (snapshots, deduplicated files) name these blocks too
+    if (fat_chain_shared(entry->first_block, UINT32_MAX)) return -1;
+    uint32_t got;
+    uint32_t start = fat_find_extent(blocks, &got, UINT32_MAX);
+    if (start == FAT_EOC || got < blocks) return -1;
+    fat_take_extent(start, blocks);
+    
+    uint32_t old = entry->first_block, b = old;
+    for (uint32_t i = 0; i < blocks; i++, b = fs->fat_table[b]) {
+        memcpy(fat_block(start + i), fat_block(b), fs->block_size);
+        fat_mark_block(start + i);
+        if (dedup_next) dedup_insert(start + i);
+    }
+    entry->first_block = start;
+    fat_mark_entry(entry_idx);
+    fat_free_chain(old);
+    *moved_blocks += blocks;
+    return (fat_commit() < 0) ? -2 : 1;
+}
+
+// Background step: look at up to DEFRAG_SCAN_BATCH entries past the cursor
+void fat_defrag_step(uint32_t max) {
+    uint32_t n = fs->sb->num_entries, moved_blocks = 0;
+    for (uint32_t scanned = 0; scanned < DEFRAG_SCAN_BATCH && scanned < n && max > 0; scanned++) {
+        if (defrag_cursor >= n) defrag_cursor = 0;
+        int rc = fat_defrag_file(defrag_cursor++, &moved_blocks);
+        if (rc == -2) break;  // Nothing more can be committed now
+        if (rc > 0) max--;
+    }
+}
+
+int fat_defrag(uint32_t max) {
+    uint32_t files, extents, fragmented;
+    fat_fragmentation(&files, &extents, &fragmented);
+    printf("Before: %u files in %u extents, %u fragmented\n", files, extents, fragmented);
+    
+    uint32_t moved = 0, moved_blocks = 0, stuck = 0;
+    for (uint32_t i = 0; i < fs->sb->num_entries && moved < max; i++) {
+        int rc = fat_defrag_file(i, &moved_blocks);
+        if (rc == -2) {
+            fprintf(stderr, "defrag: %s\n", strerror(errno));
+            return -1;
+        }
+        if (rc > 0) moved++;
+        if (rc < 0) stuck++;
+    }
+    
+    uint32_t dead = dead_entry_count;
+    fat_compact_entries();
+    if (fat_commit() < 0) {
+        fprintf(stderr, "defrag: %s\n", strerror(errno));
+        return -1;
+    }
     
+    fat_fragmentation(&files, &extents, &fragmented);
+    printf("After:  %u files in %u extents, %u fragmented\n", files, extents, fragmented);
+    printf("Moved %u file%s (%u blocks), reclaimed %u entry slot%s",
+           moved, moved == 1 ? "" : "s", moved_blocks, dead, dead == 1 ? "" : "s");
+    if (stuck > 0) printf("; %u shared or without a free extent large enough", stuck);
+    printf("\n");
     return 0;
 }
 
-void fat_head(int num_lines, const char *filename) {
-    if (!filename) {
-        fprintf(stderr, "head: missing file operand\n");
-        return;
+/* ---------- Substring Search ---------- */
+// mem_find() compares the needle's first and last bytes against a whole
+// vector of positions at once and only runs memcmp where both match.
+// x86-64 always has SSE2; AVX2 is used when the CPU reports it.
+typedef const char *(*mem_find_fn)(const char *hay, size_t hay_len, const char *needle, size_t needle_len);
+mem_find_fn mem_find_impl = NULL;
+
+const char *mem_find_scalar(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    while (hay_len >= needle_len) {
+        const char *p = memchr(hay, needle[0], hay_len - needle_len + 1);
+        if (!p) return NULL;
+        if (memcmp(p, needle, needle_len) == 0) return p;
+        hay_len -= (p - hay) + 1;
+        hay = p + 1;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__)
+const char *mem_find_sse2(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 16 <= hay_len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + needle_len - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            const char *p = hay + i + __builtin_ctz(mask);
+            if (memcmp(p, needle, needle_len) == 0) return p;
+        }
+    }
+    return mem_find_scalar(hay + i, hay_len - i, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+const char *mem_find_avx2(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 32 <= hay_len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + needle_len - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            const char *p = hay + i + __builtin_ctz(mask);
+            if (memcmp(p, needle, needle_len) == 0) return p;
+        }
+    }
+    return mem_find_sse2(hay + i, hay_len - i, needle, needle_len);
+}
+#endif
+
+const char *mem_find(const char *hay, size_t hay_len, const char *needle, size_t needle_len) {
+    if (!mem_find_impl) {
+        mem_find_impl = mem_find_scalar;
+#if defined(__x86_64__)
+        mem_find_impl = __builtin_cpu_supports("avx2") ? mem_find_avx2 : mem_find_sse2;
+#endif
+    }
+    if (needle_len == 0) return hay;
+    if (hay_len < needle_len) return NULL;
+    return mem_find_impl(hay, hay_len, needle, needle_len);
+}
+
+/* ---------- Regular Expressions ---------- */
+// grep -E compiles a POSIX extended regular expression into a Thompson NFA
+// once. Lines are then run through a DFA whose states (sets of NFA states)
+// are built the first time they are reached and cached. If the cache fills
+// up, the rest of the line is matched by stepping the NFA directly. The
+// longest literal that every match must contain is kept as a prefilter, so
+// mem_find() skips lines that cannot match.
+#define RE_MAX_STATES 8192       // NFA states one pattern may compile to
+#define RE_MAX_REPEAT 255        // Largest bound in {m,n}
+#define RE_DFA_MAX_STATES 1024   // DFA states cached per matcher
+#define RE_UNKNOWN -1            // DFA transition not computed yet
+
+enum { RE_SET, RE_SPLIT, RE_BOL, RE_EOL, RE_MATCH };
+
+typedef struct {
+    uint8_t type;
+    uint32_t out, out1;  // Next state; out1 is the second branch of a split
+    uint64_t set[4];     // RE_SET: bytes it accepts
+} re_state;
+
+typedef struct {
+    re_state *states;
+    uint32_t count, cap;
+    uint32_t start;
+    char *literal;       // Every match contains it; may be empty
+    size_t literal_len;
+} regex;
+
+// Parse tree, only kept while compiling
+enum { RN_SET, RN_CAT, RN_ALT, RN_REPEAT, RN_BOL, RN_EOL, RN_EMPTY };
+
+typedef struct re_node {
+    uint8_t type;
+    struct re_node *left, *right;
+    int min, max;        // RN_REPEAT bounds; max < 0 means unbounded
+    uint64_t set[4];
+} re_node;
+
+typedef struct {
+    const char *p;
+    re_node *nodes;
+    uint32_t count, cap;
+    const char *error;
+    regex *re;
+} re_parser;
+
+re_node *re_node_new(re_parser *ps, uint8_t type) {
+    if (ps->count == ps->cap) {
+        ps->error = "pattern too large";
+        return NULL;
+    }
+    re_node *n = &ps->nodes[ps->count++];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    return n;
+}
+
+void re_set_add(uint64_t *set, int c) {
+    set[(uint8_t)c / 64] |= 1ULL << ((uint8_t)c % 64);
+}
+
+int re_set_has(const uint64_t *set, uint8_t c) {
+    return (set[c / 64] >> (c % 64)) & 1;
+}
+
+void re_set_class(uint64_t *set, int (*is)(int)) {
+    for (int c = 0; c < 256; c++) {
+        if (is(c)) re_set_add(set, c);
+    }
+}
+
+int re_is_word(int c) {
+    return isalnum(c) || c == '_';
+}
+
+// \d \w \s and their negations; returns 0 for any other escape
+int re_escape_class(char e, uint64_t *set) {
+    int (*is)(int) = NULL;
+    switch (tolower((unsigned char)e)) {
+    case 'd': is = isdigit; break;
+    case 'w': is = re_is_word; break;
+    case 's': is = isspace; break;
+    default: return 0;
+    }
+    re_set_class(set, is);
+    if (isupper((unsigned char)e)) {
+        for (int i = 0; i < 4; i++) set[i] = ~set[i];
+    }
+    return 1;
+}
+
+// A bracket expression; ps->p is just past the '['
+int re_parse_bracket(re_parser *ps, uint64_t *set) {
+    static const struct { const char *name; int (*is)(int); } classes[] = {
+        {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum}, {"space", isspace},
+        {"upper", isupper}, {"lower", islower}, {"punct", ispunct}, {"xdigit", isxdigit},
+        {"blank", isblank}, {"cntrl", iscntrl}, {"print", isprint}, {"graph", isgraph},
+    };
+    int negate = (*ps->p == '^');
+    if (negate) ps->p++;
+    
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        first = 0;
+        if (ps->p[0] == '[' && ps->p[1] == ':') {
+            const char *end = strstr(ps->p + 2, ":]");
+            size_t i, len = end ? (size_t)(end - ps->p - 2) : 0;
+            for (i = 0; end && i < sizeof(classes) / sizeof(classes[0]); i++) {
+                if (strlen(classes[i].name) == len && strncmp(classes[i].name, ps->p + 2, len) == 0) break;
+            }
+            if (!end || i == sizeof(classes) / sizeof(classes[0])) {
+                ps->error = "unknown character class";
+                return -1;
+            }
+            re_set_class(set, classes[i].is);
+            ps->p = end + 2;
+            continue;
+        }
+        
+        uint8_t lo = (uint8_t)*ps->p++;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            uint8_t hi = (uint8_t)ps->p[1];
+            if (hi < lo) {
+                ps->error = "invalid range in brackets";
+                return -1;
+            }
+            for (int c = lo; c <= hi; c++) re_set_add(set, c);
+            ps->p += 2;
+        } else {
+            re_set_add(set, lo);
+        }
+    }
+    if (*ps->p != ']') {
+        ps->error = "unmatched [";
+        return -1;
+    }
+    ps->p++;
+    if (negate) {
+        for (int i = 0; i < 4; i++) set[i] = ~set[i];
+        set['\n' / 64] &= ~(1ULL << ('\n' % 64));
+    }
+    return 0;
+}
+
+re_node *re_parse_alt(re_parser *ps);
+
+re_node *re_parse_atom(re_parser *ps) {
+    char c = *ps->p++;
+    re_node *n;
+    if (c == '(') {
+        n = re_parse_alt(ps);
+        if (!n) return NULL;
+        if (*ps->p != ')') {
+            ps->error = "unmatched (";
+            return NULL;
+        }
+        ps->p++;
+        return n;
+    }
+    if (c == '^') return re_node_new(ps, RN_BOL);
+    if (c == '$') return re_node_new(ps, RN_EOL);
+    
+    n = re_node_new(ps, RN_SET);
+    if (!n) return NULL;
+    if (c == '.') {
+        for (int i = 0; i < 4; i++) n->set[i] = ~0ULL;
+        n->set['\n' / 64] &= ~(1ULL << ('\n' % 64));
+    } else if (c == '[') {
+        if (re_parse_bracket(ps, n->set) < 0) return NULL;
+    } else if (c == '\\') {
+        if (!*ps->p) {
+            ps->error = "trailing backslash";
+            return NULL;
+        }
+        c = *ps->p++;
+        if (!re_escape_class(c, n->set)) re_set_add(n->set, c);
+    } else {
+        re_set_add(n->set, c);
+    }
+    return n;
+}
+
+// Read a {m}, {m,} or {m,n} bound; anything else leaves '{' a literal
+int re_parse_bound(re_parser *ps, int *min, int *max) {
+    const char *p = ps->p + 1;
+    if (!isdigit((unsigned char)*p)) return 0;
+    *min = (int)strtol(p, (char **)&p, 10);
+    *max = *min;
+    if (*p == ',') {
+        p++;
+        *max = isdigit((unsigned char)*p) ? (int)strtol(p, (char **)&p, 10) : -1;
+    }
+    if (*p != '}') return 0;
+    if (*min > RE_MAX_REPEAT || *max > RE_MAX_REPEAT || (*max >= 0 && *max < *min)) {
+        ps->error = "invalid repetition bound";
+        return -1;
+    }
+    ps->p = p + 1;
+    return 1;
+}
+
+re_node *re_parse_repeat(re_parser *ps) {
+    re_node *n = re_parse_atom(ps);
+    while (n) {
+        int min, max, bound = 0;
+        char c = *ps->p;
+        if (c == '*') {
+            min = 0;
+            max = -1;
+        } else if (c == '+') {
+            min = 1;
+            max = -1;
+        } else if (c == '?') {
+            min = 0;
+            max = 1;
+        } else if (c == '{' && (bound = re_parse_bound(ps, &min, &max)) != 0) {
+            if (bound < 0) return NULL;
+        } else {
+            break;
+        }
+        if (!bound) ps->p++;
+        
+        re_node *r = re_node_new(ps, RN_REPEAT);
+        if (!r) return NULL;
+        r->left = n;
+        r->min = min;
+        r->max = max;
+        n = r;
+    }
+    return n;
+}
+
+re_node *re_parse_cat(re_parser *ps) {
+    re_node *n = NULL;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        // A quantifier with nothing before it stands for itself
+        re_node *next;
+        if ((*ps->p == '*' || *ps->p == '+' || *ps->p == '?') && !n) {
+            next = re_node_new(ps, RN_SET);
+            if (next) re_set_add(next->set, *ps->p++);
+        } else {
+            next = re_parse_repeat(ps);
+        }
+        if (!next) return NULL;
+        if (!n) {
+            n = next;
+            continue;
+        }
+        re_node *cat = re_node_new(ps, RN_CAT);
+        if (!cat) return NULL;
+        cat->left = n;
+        cat->right = next;
+        n = cat;
+    }
+    return n ? n : re_node_new(ps, RN_EMPTY);
+}
+
+re_node *re_parse_alt(re_parser *ps) {
+    re_node *n = re_parse_cat(ps);
+    while (n && *ps->p == '|') {
+        ps->p++;
+        re_node *right = re_parse_cat(ps);
+        if (!right) return NULL;
+        re_node *alt = re_node_new(ps, RN_ALT);
+        if (!alt) return NULL;
+        alt->left = n;
+        alt->right = right;
+        n = alt;
+    }
+    return n;
+}
+
+uint32_t re_add_state(re_parser *ps, uint8_t type, uint32_t out, uint32_t out1) {
+    regex *re = ps->re;
+    if (re->count == RE_MAX_STATES) {
+        ps->error = "pattern too large";
+        return 0;
+    }
+    if (re->count == re->cap) {
+        uint32_t cap = re->cap ? re->cap * 2 : 64;
+        re_state *states = realloc(re->states, cap * sizeof(re_state));
+        if (!states) {
+            ps->error = strerror(ENOMEM);
+            return 0;
+        }
+        re->states = states;
+        re->cap = cap;
+    }
+    re_state *s = &re->states[re->count];
+    memset(s, 0, sizeof(*s));
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    return re->count++;
+}
+
+// Emit states for n that continue at next; returns the entry state
+uint32_t re_emit(re_parser *ps, const re_node *n, uint32_t next) {
+    if (ps->error) return 0;
+    switch (n->type) {
+    case RN_SET: {
+        uint32_t s = re_add_state(ps, RE_SET, next, 0);
+        if (!ps->error) memcpy(ps->re->states[s].set, n->set, sizeof(n->set));
+        return s;
     }
-    
-    uint32_t entry_idx = fat_resolve_path(filename);
-    if (entry_idx == (uint32_t)-1) {
-        fprintf(stderr, "head: %s: No such file\n", filename);
-        return;
+    case RN_CAT:
+        return re_emit(ps, n->left, re_emit(ps, n->right, next));
+    case RN_ALT: {
+        uint32_t left = re_emit(ps, n->left, next);
+        return re_add_state(ps, RE_SPLIT, left, re_emit(ps, n->right, next));
     }
-    
-    if (fs->dir_entries[entry_idx].is_dir) {
-        fprintf(stderr, "head: %s: Is a directory\n", filename);
+    case RN_BOL:
+        return re_add_state(ps, RE_BOL, next, 0);
+    case RN_EOL:
+        return re_add_state(ps, RE_EOL, next, 0);
+    case RN_REPEAT: {
+        uint32_t tail = next;
+        if (n->max < 0) {
+            // Loop: a split that either runs the body again or leaves
+            tail = re_add_state(ps, RE_SPLIT, 0, next);
+            uint32_t body = re_emit(ps, n->left, tail);
+            if (ps->error) return 0;
+            ps->re->states[tail].out = body;
+        } else {
+            for (int i = n->min; i < n->max && !ps->error; i++) {
+                tail = re_add_state(ps, RE_SPLIT, re_emit(ps, n->left, tail), next);
+            }
+        }
+        for (int i = 0; i < n->min && !ps->error; i++) tail = re_emit(ps, n->left, tail);
+        return tail;
+    }
+    default:
+        return next;
+    }
+}
+
+// The longest run of single bytes that a match must contain, taken from
+// the top-level concatenation
+void re_find_literal(regex *re, const re_node *n, uint32_t nodes) {
+    const re_node **seq = malloc(nodes * sizeof(re_node *));
+    char *run = malloc(nodes + 1);
+    re->literal = malloc(nodes + 1);
+    re->literal_len = 0;
+    if (!seq || !run || !re->literal) {
+        free(seq);
+        free(run);
+        if (re->literal) re->literal[0] = '\0';
         return;
     }
     
-    char *content = fat_read_file(entry_idx);
-    if (!content) return;
-    
-    // Split into lines and print first N
-    char *content_copy = strdup(content);
-    char *line = strtok(content_copy, "\n");
     int count = 0;
-    
-    while (line && count < num_lines) {
-        printf("%s\n", line);
-        count++;
-        line = strtok(NULL, "\n");
+    for (; n->type == RN_CAT; n = n->left) seq[count++] = n->right;
+    seq[count++] = n;
+    size_t run_len = 0;
+    for (int i = count - 1; i >= -1; i--) {
+        const re_node *item = (i >= 0) ? seq[i] : NULL;
+        int single = item && item->type == RN_SET &&
+                     __builtin_popcountll(item->set[0]) + __builtin_popcountll(item->set[1]) +
+                     __builtin_popcountll(item->set[2]) + __builtin_popcountll(item->set[3]) == 1;
+        if (single) {
+            for (int c = 0; c < 256; c++) {
+                if (re_set_has(item->set, c)) run[run_len++] = (char)c;
+            }
+            continue;
+        }
+        if (run_len > re->literal_len) {
+            memcpy(re->literal, run, run_len);
+            re->literal_len = run_len;
+        }
+        // Anchors and empty groups match no text, so a run continues past them
+        if (!item || (item->type != RN_BOL && item->type != RN_EOL && item->type != RN_EMPTY)) run_len = 0;
     }
-    
-    free(content_copy);
-    free(content);
+    re->literal[re->literal_len] = '\0';
+    free(seq);
+    free(run);
 }
 
-void fat_tail(int num_lines, const char *filename) {
-    if (!filename) {
-        fprintf(stderr, "tail: missing file operand\n");
-        return;
+void re_free(regex *re) {
+    if (!re) return;
+    free(re->states);
+    free(re->literal);
+    free(re);
+}
+
+regex *re_compile(const char *pattern, const char **error) {
+    re_parser ps = {0};
+    ps.p = pattern;
+    ps.cap = 3 * strlen(pattern) + 4;
+    ps.nodes = malloc(ps.cap * sizeof(re_node));
+    ps.re = calloc(1, sizeof(regex));
+    if (!ps.nodes || !ps.re) {
+        free(ps.nodes);
+        free(ps.re);
+        *error = strerror(ENOMEM);
+        return NULL;
     }
     
-    uint32_t entry_idx = fat_resolve_path(filename);
-    if (entry_idx == (uint32_t)-1) {
-        fprintf(stderr, "tail: %s: No such file\n", filename);
-        return;
+    re_node *root = re_parse_alt(&ps);
+    if (root && *ps.p == ')') ps.error = "unmatched )";
+    if (root && !ps.error) {
+        uint32_t match = re_add_state(&ps, RE_MATCH, 0, 0);
+        ps.re->start = re_emit(&ps, root, match);
+        re_find_literal(ps.re, root, ps.count);
     }
-    
-    if (fs->dir_entries[entry_idx].is_dir) {
-        fprintf(stderr, "tail: %s: Is a directory\n", filename);
-        return;
+    free(ps.nodes);
+    if (ps.error) {
+        *error = ps.error;
+        re_free(ps.re);
+        return NULL;
     }
-    
-    char *content = fat_read_file(entry_idx);
-    if (!content) return;
-    
-    // Count total lines first
-    char *content_copy1 = strdup(content);
-    char *line = strtok(content_copy1, "\n");
-    int total_lines = 0;
-    while (line) {
-        total_lines++;
-        line = strtok(NULL, "\n");
+    return ps.re;
+}
+
+/* A DFA state is the sorted set of RE_SET, RE_EOL and RE_MATCH states the
+ * NFA can be in after some input; splits and ^ are resolved while the set
+ * is built. Every step also adds the start state, which is what lets a
+ * match begin anywhere in the line. */
+typedef struct {
+    int32_t next[256];    // DFA state after each byte, or RE_UNKNOWN
+    uint32_t first, count;  // Its NFA states: members[first, first + count)
+    uint8_t match;        // Holds RE_MATCH: the line matches already
+    uint8_t match_eol;    // Reaches RE_MATCH if the line ends here
+} re_dfa_state;
+
+typedef struct {
+    const regex *re;
+    re_dfa_state *states;
+    uint32_t count, cap;
+    uint32_t *members;
+    size_t members_len, members_cap;
+    int32_t table[2 * RE_DFA_MAX_STATES];  // Open-addressed: DFA state + 1
+    uint32_t *mark, gen;    // Closure bookkeeping, one slot per NFA state
+    uint32_t *stack, *list, *spare;
+} re_dfa;
+
+// Add the states reachable from s without consuming input to list. ^ holds
+// only when bol is set; $ is kept in the list unless eol is set.
+void re_closure(re_dfa *d, uint32_t s, int bol, int eol, uint32_t *list, uint32_t *n) {
+    const re_state *states = d->re->states;
+    uint32_t depth = 0;
+    d->stack[depth++] = s;
+    while (depth > 0) {
+        s = d->stack[--depth];
+        if (d->mark[s] == d->gen) continue;
+        d->mark[s] = d->gen;
+        switch (states[s].type) {
+        case RE_SPLIT:
+            d->stack[depth++] = states[s].out1;
+            d->stack[depth++] = states[s].out;
+            break;
+        case RE_BOL:
+            if (bol) d->stack[depth++] = states[s].out;
+            break;
+        case RE_EOL:
+            if (eol) {
+                d->stack[depth++] = states[s].out;
+            } else {
+                list[(*n)++] = s;
+            }
+            break;
+        default:
+            list[(*n)++] = s;
+        }
     }
-    free(content_copy1);
-    
-    // Calculate starting line
-    int start_line = (total_lines > num_lines) ? (total_lines - num_lines) : 0;
-    
-    // Print from start_line to end
-    char *content_copy2 = strdup(content);
-    line = strtok(content_copy2, "\n");
-    int count = 0;
-    
-    while (line) {
-        if (count >= start_line) {
-            printf("%s\n", line);
+}
+
+// The set after reading byte c from cur[0, n); returns its size
+uint32_t re_step(re_dfa *d, const uint32_t *cur, uint32_t n, uint8_t c, uint32_t *out) {
+    const re_state *states = d->re->states;
+    uint32_t count = 0;
+    d->gen++;
+    for (uint32_t i = 0; i < n; i++) {
+        if (states[cur[i]].type == RE_SET && re_set_has(states[cur[i]].set, c)) {
+            re_closure(d, states[cur[i]].out, 0, 0, out, &count);
         }
-        count++;
-        line = strtok(NULL, "\n");
     }
-    
-    free(content_copy2);
-    free(content);
+    re_closure(d, d->re->start, 0, 0, out, &count);
+    return count;
 }
 
-int fat_rmdir(const char *path) {
-    if (!path) {
-        fprintf(stderr, "rmdir: missing operand\n");
-        return -1;
+int re_has_match(re_dfa *d, const uint32_t *set, uint32_t n, int eol) {
+    const re_state *states = d->re->states;
+    uint32_t count = 0;
+    d->gen++;
+    for (uint32_t i = 0; i < n; i++) {
+        if (states[set[i]].type == RE_MATCH) return 1;
+        if (eol && states[set[i]].type == RE_EOL) {
+            count = 0;
+            re_closure(d, states[set[i]].out, 0, 1, d->spare, &count);
+            for (uint32_t j = 0; j < count; j++) {
+                if (states[d->spare[j]].type == RE_MATCH) return 1;
+            }
+        }
     }
-    
-    uint32_t entry_idx = fat_resolve_path(path);
-    if (entry_idx == (uint32_t)-1) {
-        fprintf(stderr, "rmdir: failed to remove '%s': No such file or directory\n", path);
-        return -1;
+    return 0;
+}
+
+int re_cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Find or add the DFA state for set[0, n); RE_UNKNOWN once the cache is full
+// or cannot grow, which sends the caller to the NFA
+int32_t re_dfa_state_for(re_dfa *d, uint32_t *set, uint32_t n) {
+    qsort(set, n, sizeof(uint32_t), re_cmp_u32);
+    uint32_t mask = 2 * RE_DFA_MAX_STATES - 1;
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < n; i++) h = (h ^ set[i]) * 16777619u;
+    h &= mask;
+    for (; d->table[h] != 0; h = (h + 1) & mask) {
+        re_dfa_state *s = &d->states[d->table[h] - 1];
+        if (s->count == n && memcmp(d->members + s->first, set, n * sizeof(uint32_t)) == 0) {
+            return d->table[h] - 1;
+        }
     }
-    
-    dir_entry *entry = &fs->dir_entries[entry_idx];
-    
-    // Must be a directory
-    if (!entry->is_dir) {
-        fprintf(stderr, "rmdir: failed to remove '%s': Not a directory\n", path);
-        return -1;
+    if (d->count == RE_DFA_MAX_STATES) return RE_UNKNOWN;
+    
+    if (d->members_len + n > d->members_cap) {
+        size_t cap = (d->members_len + n) * 2;
+        uint32_t *members = realloc(d->members, cap * sizeof(uint32_t));
+        if (!members) return RE_UNKNOWN;
+        d->members = members;
+        d->members_cap = cap;
     }
-    
-    // Cannot remove root directory
-    if (entry_idx == 0) {
-        fprintf(stderr, "rmdir: failed to remove '/': Cannot remove root directory\n");
-        return -1;
+    if (d->count == d->cap) {
+        uint32_t cap = d->cap ? d->cap * 2 : 16;
+        re_dfa_state *states = realloc(d->states, cap * sizeof(re_dfa_state));
+        if (!states) return RE_UNKNOWN;
+        d->states = states;
+        d->cap = cap;
     }
-    
-    // Check if directory is empty (no children)
-    for (uint32_t i = 0; i < fs->num_entries; i++) {
-        if (fs->dir_entries[i].is_used && 
-            fs->dir_entries[i].parent_entry == entry_idx) {
-            fprintf(stderr, "rmdir: failed to remove '%s': Directory not empty\n", path);
-            return -1;
-        }
+    re_dfa_state *s = &d->states[d->count];
+    memset(s->next, 0xFF, sizeof(s->next));
+    s->first = d->members_len;
+    s->count = n;
+    memcpy(d->members + s->first, set, n * sizeof(uint32_t));
+    d->members_len += n;
+    s->match = re_has_match(d, set, n, 0);
+    s->match_eol = re_has_match(d, set, n, 1);
+    d->table[h] = d->count + 1;
+    return d->count++;
+}
+
+void re_dfa_free(re_dfa *d) {
+    if (!d) return;
+    free(d->states);
+    free(d->members);
+    free(d->mark);
+    free(d->stack);
+    free(d->list);
+    free(d->spare);
+    free(d);
+}
+
+re_dfa *re_dfa_new(const regex *re) {
+    re_dfa *d = calloc(1, sizeof(re_dfa));
+    if (!d) return NULL;
+    d->re = re;
+    d->mark = calloc(re->count, sizeof(uint32_t));
+    d->stack = malloc((2 * re->count + 1) * sizeof(uint32_t));
+    d->list = malloc(re->count * sizeof(uint32_t));
+    d->spare = malloc(re->count * sizeof(uint32_t));
+    if (!d->mark || !d->stack || !d->list || !d->spare) {
+        re_dfa_free(d);
+        return NULL;
     }
     
-    // Cannot remove current directory
-    if (entry_idx == fs->current_dir) {
-        fprintf(stderr, "rmdir: failed to remove '%s': Cannot remove current directory\n", path);
-        return -1;
+    // State 0 is the start of a line, the only place ^ holds
+    uint32_t n = 0;
+    d->gen++;
+    re_closure(d, re->start, 1, 0, d->list, &n);
+    if (re_dfa_state_for(d, d->list, n) == RE_UNKNOWN) {
+        re_dfa_free(d);
+        return NULL;
     }
-    
-    // Mark entry as unused
-    entry->is_used = 0;
-    
-    // Try to remove real directory if it exists
-    char realdir[PATH_MAX];
-    snprintf(realdir, sizeof(realdir), "%s/%s", ROOT_PATH, path);
-    rmdir(realdir);  // Ignore errors if directory doesn't exist
-    
-    printf("Removed directory '%s' from virtual file system\n", path);
-    
-    return 0;
+    return d;
 }
 
-int fat_rm(const char *path) {
-    if (!path) {
-        fprintf(stderr, "rm: missing operand\n");
-        return -1;
+// Step the NFA itself through the rest of a line, from the set of DFA state s
+int re_nfa_run(re_dfa *d, int32_t s, const uint8_t *p, const uint8_t *end) {
+    uint32_t *cur = malloc(d->re->count * sizeof(uint32_t));
+    uint32_t *next = malloc(d->re->count * sizeof(uint32_t));
+    if (!cur || !next) {
+        free(cur);
+        free(next);
+        return 0;
     }
-    
-    uint32_t entry_idx = fat_resolve_path(path);
-    if (entry_idx == (uint32_t)-1) {
-        fprintf(stderr, "rm: cannot remove '%s': No such file or directory\n", path);
+    uint32_t n = d->states[s].count;
+    memcpy(cur, d->members + d->states[s].first, n * sizeof(uint32_t));
+    
+    int matched = 0;
+    for (; p < end && !matched; p++) {
+        n = re_step(d, cur, n, *p, next);
+        uint32_t *swap = cur;
+        cur = next;
+        next = swap;
+        matched = re_has_match(d, cur, n, 0);
+    }
+    if (!matched) matched = re_has_match(d, cur, n, 1);
+    free(cur);
+    free(next);
+    return matched;
+}
+
+// True if some part of line[0, len) matches
+int re_match_line(re_dfa *d, const char *line, size_t len) {
+    const uint8_t *p = (const uint8_t *)line, *end = p + len;
+    int32_t s = 0;
+    if (d->states[s].match) return 1;
+    for (; p < end; p++) {
+        int32_t t = d->states[s].next[*p];
+        if (t == RE_UNKNOWN) {
+            uint32_t n = re_step(d, d->members + d->states[s].first, d->states[s].count, *p, d->list);
+            t = re_dfa_state_for(d, d->list, n);
+            if (t == RE_UNKNOWN) return re_nfa_run(d, s, p, end);
+            d->states[s].next[*p] = t;
+        }
+        s = t;
+        if (d->states[s].match) return 1;
+    }
+    return d->states[s].match_eol;
+}
+
+/* ---------- grep ---------- */
+// What grep looks for. Lines that lack literal are skipped with mem_find();
+// with grep -E the rest must also match the DFA, which literal only narrows.
+typedef struct {
+    const char *literal;
+    size_t literal_len;
+    re_dfa *dfa;          // NULL for a fixed-string search
+} grep_matcher;
+
+// Set m up for pattern; with extended it is compiled into a regex that the
+// matcher's DFA owns. Prints the error and returns -1 for a bad pattern.
+int grep_matcher_init(grep_matcher *m, const char *pattern, int extended) {
+    memset(m, 0, sizeof(*m));
+    if (!extended) {
+        m->literal = pattern;
+        m->literal_len = strlen(pattern);
+        return 0;
+    }
+    const char *error = NULL;
+    regex *re = re_compile(pattern, &error);
+    if (!re) {
+        fprintf(stderr, "grep: %s: %s\n", pattern, error);
         return -1;
     }
-    
-    dir_entry *entry = &fs->dir_entries[entry_idx];
-    
-    // Don't allow removing directories (use rmdir for that)
-    if (entry->is_dir) {
-        fprintf(stderr, "rm: cannot remove '%s': Is a directory\n", path);
+    m->dfa = re_dfa_new(re);
+    if (!m->dfa) {
+        fprintf(stderr, "grep: %s\n", strerror(ENOMEM));
+        re_free(re);
         return -1;
     }
-    
-    // Free the blocks used by this file
-    if (entry->first_block != FAT_EOC) {
-        fat_free_chain(entry->first_block);
+    m->literal = re->literal;
+    m->literal_len = re->literal_len;
+    return 0;
+}
+
+void grep_matcher_free(grep_matcher *m) {
+    if (!m->dfa) return;
+    re_free((regex *)m->dfa->re);
+    re_dfa_free(m->dfa);
+}
+
+// Print each line of buf[0, len) that matches to out, after prefix and a
+// colon when prefix is set. The literal is searched over the whole buffer;
+// a hit is only then widened to the line around it, and the search resumes
+// after that line.
+void grep_lines(FILE *out, const char *prefix, grep_matcher *m, const char *buf, size_t len) {
+    const char *p = buf, *end = buf + len;
+    while (p < end) {
+        const char *hit = mem_find(p, end - p, m->literal, m->literal_len);
+        if (!hit) break;
+        
+        const char *start = hit;
+        while (start > p && start[-1] != '\n') start--;
+        const char *nl = memchr(hit, '\n', end - hit);
+        const char *stop = nl ? nl : end;
+        if (!m->dfa || re_match_line(m->dfa, start, stop - start)) {
+            if (prefix) fprintf(out, "%s:", prefix);
+            fwrite(start, 1, stop - start, out);
+            putc('\n', out);
+        }
+        if (!nl) break;
+        p = nl + 1;
     }
-    
-    // Mark entry as unused
-    entry->is_used = 0;
-    entry->first_block = FAT_EOC;
-    entry->size = 0;
-    
-    // Try to remove the real file too (if it exists)
-    char realfile[PATH_MAX];
-    snprintf(realfile, sizeof(realfile), "%s/%s", ROOT_PATH, path);
-    unlink(realfile);  // Ignore errors if file doesn't exist
-    
-    printf("Removed '%s' from virtual file system\n", path);
-    
+}
+
+int grep_carry(char **carry, size_t *len, size_t *cap, const char *p, size_t n) {
+    if (n == 0) return 0;
+    if (*len + n > *cap) {
+        size_t grown = (*len + n) * 2;
+        char *larger = realloc(*carry, grown);
+        if (!larger) return -1;
+        *carry = larger;
+        *cap = grown;
+    }
+    memcpy(*carry + *len, p, n);
+    *len += n;
     return 0;
 }
 
-void fat_grep(const char *pattern, const char *filename) {
+// Search one file, writing its matching lines to out. Returns -1 with errno
+// set if the file could not be searched to the end.
+int grep_file(FILE *out, const char *prefix, grep_matcher *m, uint32_t entry_idx) {
+    fat_file *f = fat_open(entry_idx);
+    if (!f) return -1;
+    
+    // Whole lines are searched in place inside each span of the file; only
+    // a line that crosses from one span into the next is gathered in carry
+    const char *span;
+    char *carry = NULL;
+    size_t carry_len = 0, carry_cap = 0, n;
+    int rc = 0;
+    while (rc == 0 && (n = fat_span(f, &span, SIZE_MAX)) > 0) {
+        const char *end = span + n, *body = span;
+        const char *first_nl = memchr(span, '\n', n);
+        const char *tail = end;
+        while (first_nl && tail > span && tail[-1] != '\n') tail--;
+        
+        // The line carried in ends at this span's first newline
+        if (carry_len > 0 && first_nl) {
+            if (grep_carry(&carry, &carry_len, &carry_cap, span, first_nl - span) < 0) {
+                rc = -1;
+                break;
+            }
+            grep_lines(out, prefix, m, carry, carry_len);
+            carry_len = 0;
+            body = first_nl + 1;
+        }
+        if (first_nl && tail > body) grep_lines(out, prefix, m, body, tail - body);
+        if (!first_nl) tail = body;
+        rc = grep_carry(&carry, &carry_len, &carry_cap, tail, end - tail);
+    }
+    if (rc == 0 && carry_len > 0) grep_lines(out, prefix, m, carry, carry_len);
+    
+    free(carry);
+    fat_close(f);
+    if (rc < 0) errno = ENOMEM;
+    return rc;
+}
+
+void fat_grep(const char *pattern, const char *filename, int extended) {
     if (!pattern) {
         fprintf(stderr, "grep: missing pattern\n");
         return;
     }
+    grep_matcher m;
+    if (grep_matcher_init(&m, pattern, extended) < 0) return;
     
     // If reading from stdin (no filename or filename is "-")
     if (!filename || strcmp(filename, "-") == 0) {
@@ -919,15 +4880,17 @@ void fat_grep(const char *pattern, const char *filename) {
             // Remove trailing newline if present
             size_t len = strlen(line);
             if (len > 0 && line[len-1] == '\n') {
-                line[len-1] = '\0';
+                line[--len] = '\0';
             }
             
             // Only print if pattern is found
-            if (strstr(line, pattern) != NULL) {
+            if (mem_find(line, len, m.literal, m.literal_len) != NULL &&
+                (!m.dfa || re_match_line(m.dfa, line, len))) {
                 printf("%s\n", line);
                 fflush(stdout);
             }
         }
+        grep_matcher_free(&m);
         return;
     }
     
@@ -935,29 +4898,178 @@ void fat_grep(const char *pattern, const char *filename) {
     uint32_t entry_idx = fat_resolve_path(filename);
     if (entry_idx == (uint32_t)-1) {
         fprintf(stderr, "grep: %s: No such file\n", filename);
-        return;
-    }
-    
-    if (fs->dir_entries[entry_idx].is_dir) {
+    } else if (fs->dir_entries[entry_idx].is_dir) {
         fprintf(stderr, "grep: %s: Is a directory\n", filename);
-        return;
+    } else if (grep_file(stdout, NULL, &m, entry_idx) < 0) {
+        fprintf(stderr, "grep: %s: %s\n", filename, strerror(errno));
+    }
+    grep_matcher_free(&m);
+}
+
+/* ---------- Recursive grep ---------- */
+// grep -r lists the files of a subtree, then worker threads each take the
+// next whole file and search it into a private buffer. The calling thread
+// prints the buffers in listing order as they complete. Nothing writes to
+// fs while the workers run, so they read it without locks.
+#define GREP_MAX_THREADS 8
+
+typedef struct {
+    uint32_t entry;
+    char *path;
+    char *out;       // Matching lines, filled by the worker that took the file
+    size_t out_len;
+    int error;       // errno if the file could not be searched
+    int done;
+} grep_job;
+
+typedef struct {
+    grep_matcher matcher;     // Workers copy it and build their own DFA
+    grep_job *jobs;
+    uint32_t count;
+    uint32_t next;            // Next job to take, claimed atomically
+    pthread_mutex_t shared;   // Held while a worker searches with matcher itself
+    pthread_mutex_t lock;
+    pthread_cond_t finished;  // Signalled each time a job is done
+} grep_pool;
+
+// Append the files under dir to the job list, depth first in listing order.
+// depth and the sibling count are bounded so a corrupt tree cannot loop.
+// Returns -1 if the list could not be grown.
+int grep_collect(grep_pool *pool, uint32_t *cap, uint32_t dir, const char *prefix, uint32_t depth) {
+    uint32_t steps = 0;
+    if (depth > fs->sb->num_entries) return 0;
+    for (uint32_t i = fs->dir_entries[dir].first_child;
+         i < fs->sb->num_entries && steps++ < fs->sb->num_entries; i = fs->dir_entries[i].next_sibling) {
+        const char *name = fs->dir_names[i].name;
+        size_t len = strlen(prefix);
+        char *path = malloc(len + strlen(name) + 2);
+        if (!path) return -1;
+        sprintf(path, "%s%s%s", prefix, (len && prefix[len - 1] != '/') ? "/" : "", name);
+        
+        if (fs->dir_entries[i].is_dir) {
+            int rc = grep_collect(pool, cap, i, path, depth + 1);
+            free(path);
+            if (rc < 0) return -1;
+            continue;
+        }
+        if (pool->count == *cap) {
+            uint32_t grown = *cap ? *cap * 2 : 64;
+            grep_job *jobs = realloc(pool->jobs, grown * sizeof(grep_job));
+            if (!jobs) {
+                free(path);
+                return -1;
+            }
+            pool->jobs = jobs;
+            *cap = grown;
+        }
+        grep_job *job = &pool->jobs[pool->count++];
+        memset(job, 0, sizeof(*job));
+        job->entry = i;
+        job->path = path;
+    }
+    return 0;
+}
+
+void *grep_worker(void *arg) {
+    grep_pool *pool = arg;
+    grep_matcher m = pool->matcher;
+    uint32_t i;
+    
+    // DFA states are filled in as lines are matched, so none is shared. A
+    // worker that cannot build its own takes turns with the pool's instead.
+    int own = 1;
+    if (m.dfa) {
+        m.dfa = re_dfa_new(m.dfa->re);
+        own = (m.dfa != NULL);
+    }
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+        grep_job *job = &pool->jobs[i];
+        FILE *out = open_memstream(&job->out, &job->out_len);
+        if (!out) {
+            job->error = errno;
+        } else if (own) {
+            if (grep_file(out, job->path, &m, job->entry) < 0) job->error = errno;
+        } else {
+            pthread_mutex_lock(&pool->shared);
+            if (grep_file(out, job->path, &pool->matcher, job->entry) < 0) job->error = errno;
+            pthread_mutex_unlock(&pool->shared);
+        }
+        if (out) fclose(out);
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->finished);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    re_dfa_free(m.dfa);
+    return NULL;
+}
+
+int fat_grep_recursive(const char *pattern, const char *path, int extended) {
+    uint32_t root = path ? fat_resolve_path(path) : fs->current_dir;
+    if (root == (uint32_t)-1) {
+        fprintf(stderr, "grep: %s: No such file\n", path);
+        return -1;
+    }
+    if (!fs->dir_entries[root].is_dir) {
+        fat_grep(pattern, path, extended);
+        return 0;
     }
     
-    char *content = fat_read_file(entry_idx);
-    if (!content) return;
+    grep_pool pool = {0};
+    uint32_t cap = 0;
+    if (grep_matcher_init(&pool.matcher, pattern, extended) < 0) return -1;
+    if (grep_collect(&pool, &cap, root, path ? path : "", 0) < 0) {
+        fprintf(stderr, "grep: %s\n", strerror(ENOMEM));
+        for (uint32_t i = 0; i < pool.count; i++) free(pool.jobs[i].path);
+        free(pool.jobs);
+        grep_matcher_free(&pool.matcher);
+        return -1;
+    }
+    mem_find(pattern, 0, pattern, 0);  // Pick the search routine before the workers share it
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = (cpus > 0) ? (uint32_t)cpus : 1;
+    if (threads > GREP_MAX_THREADS) threads = GREP_MAX_THREADS;
+    if (threads > pool.count) threads = pool.count;
+    
+    pthread_t workers[GREP_MAX_THREADS];
+    uint32_t started = 0;
+    if (threads > 1) {
+        pthread_mutex_init(&pool.shared, NULL);
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.finished, NULL);
+        while (started < threads && pthread_create(&workers[started], NULL, grep_worker, &pool) == 0) {
+            started++;
+        }
+    }
     
-    // Make a copy since strtok modifies the string
-    char *content_copy = strdup(content);
-    char *line = strtok(content_copy, "\n");
-    while (line) {
-        if (strstr(line, pattern) != NULL) {
-            printf("%s\n", line);
+    for (uint32_t i = 0; i < pool.count; i++) {
+        grep_job *job = &pool.jobs[i];
+        if (started == 0) {
+            if (grep_file(stdout, job->path, &pool.matcher, job->entry) < 0) {
+                fprintf(stderr, "grep: %s: %s\n", job->path, strerror(errno));
+            }
+        } else {
+            pthread_mutex_lock(&pool.lock);
+            while (!job->done) pthread_cond_wait(&pool.finished, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+            fwrite(job->out, 1, job->out_len, stdout);
+            if (job->error) fprintf(stderr, "grep: %s: %s\n", job->path, strerror(job->error));
         }
-        line = strtok(NULL, "\n");
+        fflush(stdout);
+        free(job->out);
+        free(job->path);
     }
     
-    free(content_copy);
-    free(content);
+    for (uint32_t t = 0; t < started; t++) pthread_join(workers[t], NULL);
+    if (threads > 1) {
+        pthread_mutex_destroy(&pool.shared);
+        pthread_mutex_destroy(&pool.lock);
+        pthread_cond_destroy(&pool.finished);
+    }
+    free(pool.jobs);
+    grep_matcher_free(&pool.matcher);
+    return 0;
 }
 
 int do_shell_builtin(int argc, char **argv) {
@@ -984,13 +5096,35 @@ int do_shell_builtin(int argc, char **argv) {
         return 0;
     }
     else if (strcmp(argv[0], "grep") == 0) {
-        if (argc < 2) {
-            fprintf(stderr, "grep: usage: grep pattern [file]\n");
+        // -r searches every file below a directory, -E takes the pattern
+        // as an extended regular expression; flags may be combined (-rE)
+        int recursive = 0, extended = 0, arg = 1;
+        for (; arg < argc && argv[arg][0] == '-' && argv[arg][1]; arg++) {
+            if (strcmp(argv[arg], "--") == 0) {
+                arg++;
+                break;
+            }
+            for (const char *c = argv[arg] + 1; *c; c++) {
+                if (*c == 'r') {
+                    recursive = 1;
+                } else if (*c == 'E') {
+                    extended = 1;
+                } else {
+                    fprintf(stderr, "grep: invalid option -- '%c'\n", *c);
+                    return -1;
+                }
+            }
+        }
+        if (arg >= argc) {
+            fprintf(stderr, "grep: usage: grep [-rE] pattern [file]\n");
             return -1;
         }
+        if (recursive) {
+            return fat_grep_recursive(argv[arg], arg + 1 < argc ? argv[arg + 1] : NULL, extended);
+        }
         // grep pattern [file]
         // If no file, read from stdin
-        fat_grep(argv[1], argc > 2 ? argv[2] : NULL);
+        fat_grep(argv[arg], arg + 1 < argc ? argv[arg + 1] : NULL, extended);
         return 0;
     }
     else if (strcmp(argv[0], "mkdir") == 0) {
@@ -1023,12 +5157,61 @@ int do_shell_builtin(int argc, char **argv) {
         if (fat_rm(argv[1]) < 0) {
             return -1;
         }
-        // Auto-save after removing
-        char imgpath[PATH_MAX];
-        snprintf(imgpath, sizeof(imgpath), "%s/mysh_fs.img", ROOT_PATH);
-        fat_save_image(imgpath);
         return 0;
     }
+    else if (strcmp(argv[0], "snapshot") == 0) {
+        // snapshot NAME saves one; snapshot -d NAME deletes it
+        if (argc == 3 && strcmp(argv[1], "-d") == 0) {
+            return fat_snapshot_delete(argv[2]);
+        }
+        if (argc != 2) {
+            fprintf(stderr, "Usage: snapshot [-d] NAME\n");
+            return -1;
+        }
+        return fat_snapshot(argv[1]);
+    }
+    else if (strcmp(argv[0], "defrag") == 0) {
+        // defrag -n N stops after moving N files
+        uint32_t max = UINT32_MAX;
+        if (argc == 3 && strcmp(argv[1], "-n") == 0) {
+            max = (uint32_t)strtoul(argv[2], NULL, 10);
+        } else if (argc != 1) {
+            fprintf(stderr, "Usage: defrag [-n FILES]\n");
+            return -1;
+        }
+        return fat_defrag(max);
+    }
+    else if (strcmp(argv[0], "fsck") == 0) {
+        return fat_fsck();
+    }
+    else if (strcmp(argv[0], "snapshots") == 0) {
+        fat_snapshots();
+        return 0;
+    }
+    else if (strcmp(argv[0], "rollback") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Usage: rollback NAME\n");
+            return -1;
+        }
+        return fat_rollback(argv[1]);
+    }
+    else if (strcmp(argv[0], "compress") == 0) {
+        // compress [-d] FILE...: -d stores the files uncompressed again
+        int on = 1, first = 1;
+        if (argc > 1 && strcmp(argv[1], "-d") == 0) {
+            on = 0;
+            first = 2;
+        }
+        if (first >= argc) {
+            fprintf(stderr, "Usage: compress [-d] FILE...\n");
+            return -1;
+        }
+        int rc = 0;
+        for (int i = first; i < argc; i++) {
+            if (fat_compress(argv[i], on) < 0) rc = -1;
+        }
+        return rc;
+    }
     else if (strcmp(argv[0], "rmdir") == 0) {
         if (argc < 2) {
             fprintf(stderr, "rmdir: missing operand\n");
@@ -1037,10 +5220,6 @@ int do_shell_builtin(int argc, char **argv) {
         if (fat_rmdir(argv[1]) < 0) {
             return -1;
         }
-        // Auto-save after removing directory
-        char imgpath[PATH_MAX];
-        snprintf(imgpath, sizeof(imgpath), "%s/mysh_fs.img", ROOT_PATH);
-        fat_save_image(imgpath);
         return 0;
     }
     else if (strcmp(argv[0], "head") == 0) {
@@ -1099,6 +5278,27 @@ int do_shell_builtin(int argc, char **argv) {
         fat_tail(num_lines, filename);
         return 0;
     }
+    else if (strcmp(argv[0], "wc") == 0) {
+        // wc [-lwc] [file]: all three counts unless some are asked for;
+        // if no file, read from stdin
+        int what = 0, arg = 1;
+        for (; arg < argc && argv[arg][0] == '-' && argv[arg][1]; arg++) {
+            for (const char *c = argv[arg] + 1; *c; c++) {
+                if (*c == 'l') {
+                    what |= WC_LINES;
+                } else if (*c == 'w') {
+                    what |= WC_WORDS;
+                } else if (*c == 'c') {
+                    what |= WC_BYTES;
+                } else {
+                    fprintf(stderr, "wc: invalid option -- '%c'\n", *c);
+                    return -1;
+                }
+            }
+        }
+        fat_wc(what ? what : WC_LINES | WC_WORDS | WC_BYTES, arg < argc ? argv[arg] : NULL);
+        return 0;
+    }
     else if (strcmp(argv[0], "mv") == 0) {
         if (argc < 3) {
             fprintf(stderr, "mv: missing operand\n");
@@ -1108,10 +5308,6 @@ int do_shell_builtin(int argc, char **argv) {
         if (fat_mv(argv[1], argv[2]) < 0) {
             return -1;
         }
-        // Auto-save after moving
-        char imgpath[PATH_MAX];
-        snprintf(imgpath, sizeof(imgpath), "%s/mysh_fs.img", ROOT_PATH);
-        fat_save_image(imgpath);
         return 0;
     }
     else if (strcmp(argv[0], "pwd") == 0) {
@@ -1119,10 +5315,8 @@ int do_shell_builtin(int argc, char **argv) {
         return 0;
     }
     else if (strcmp(argv[0], "exit") == 0) {
-        // Save file system before exiting
-        char imgpath[PATH_MAX];
-        snprintf(imgpath, sizeof(imgpath), "%s/mysh_fs.img", ROOT_PATH);
-        fat_save_image(imgpath);
+        // Checkpoint the file system before exiting
+        fat_save_image(fs_image_path);
         
         // Save command history
         save_history();
@@ -1304,6 +5498,7 @@ int execute_pipeline(command *cmds, int num_cmds) {
             }
             
             int result = do_shell_builtin(cmds[0].argc, cmds[0].argv);
+            fflush(stdout);  // Output still buffered belongs to the redirect
             
             // Restore stdin/stdout
             if (saved_stdin >= 0) {
@@ -1317,7 +5512,7 @@ int execute_pipeline(command *cmds, int num_cmds) {
                 close(output_fd);
                 
                 // Sync output file to VFS
-                fat_sync_from_real_file(cmds[0].output_file);
+                fat_sync_from_real_file(cmds[0].output_file, cmds[0].append_mode);
             }
             
             return result;
@@ -1361,7 +5556,7 @@ int execute_pipeline(command *cmds, int num_cmds) {
             
             // Sync output file to VFS if it was redirected
             if (cmds[0].output_file) {
-                fat_sync_from_real_file(cmds[0].output_file);
+                fat_sync_from_real_file(cmds[0].output_file, cmds[0].append_mode);
             }
             
             // Check if editor was used
@@ -1373,12 +5568,9 @@ int execute_pipeline(command *cmds, int num_cmds) {
             if (is_editor) {
                 for (int i = 1; i < cmds[0].argc; i++) {
                     if (cmds[0].argv[i][0] != '-') {
-                        fat_sync_from_real_file(cmds[0].argv[i]);
+                        fat_sync_from_real_file(cmds[0].argv[i], 0);
                     }
                 }
-                char imgpath[PATH_MAX];
-                snprintf(imgpath, sizeof(imgpath), "%s/mysh_fs.img", ROOT_PATH);
-                fat_save_image(imgpath);
             }
             return 0;
         }
@@ -1386,6 +5578,13 @@ int execute_pipeline(command *cmds, int num_cmds) {
     }
     
     // Pipeline execution
+    for (int i = 0; i < num_cmds; i++) {
+        if (is_state_builtin(cmds[i].argv[0])) {
+            fprintf(stderr, "mysh: %s: cannot be used in a pipeline\n", cmds[i].argv[0]);
+            return -1;
+        }
+    }
+    
     int pipefds[2 * (num_cmds - 1)];
     
     // Create all pipes
@@ -1475,7 +5674,7 @@ int execute_pipeline(command *cmds, int num_cmds) {
     
     // Sync output file to VFS if last command had redirection
     if (num_cmds > 0 && cmds[num_cmds - 1].output_file) {
-        fat_sync_from_real_file(cmds[num_cmds - 1].output_file);
+        fat_sync_from_real_file(cmds[num_cmds - 1].output_file, cmds[num_cmds - 1].append_mode);
     }
     
     return 0;
@@ -1487,6 +5686,14 @@ int main() {
         dief("OS_PROJECT folder not found.\n");
     }
     
+    const char *zero = getenv("MYSH_FS_ZERO");
+    if (zero && strcmp(zero, "eager") == 0) zero_policy = ZERO_EAGER;
+    if (zero && strcmp(zero, "scrub") == 0) zero_policy = ZERO_SCRUB;
+    const char *dedup = getenv("MYSH_FS_DEDUP");
+    dedup_enabled = (dedup && strcmp(dedup, "1") == 0);
+    const char *defrag = getenv("MYSH_FS_DEFRAG");
+    if (defrag) defrag_batch = (uint32_t)strtoul(defrag, NULL, 10);
+    
     fat_init();
     load_history();  // Load command history on startup
     
@@ -1494,6 +5701,9 @@ int main() {
     size_t linecap = 0;
     
     while (1) {
+        if (scrub_pending > 0) fat_scrub_step(SCRUB_BATCH);
+        if (defrag_batch > 0) fat_defrag_step(defrag_batch);
+        
         printf("mysh:");
         fat_pwd();
         printf("$ ");
@@ -1502,6 +5712,7 @@ int main() {
         ssize_t nread = getline(&line, &linecap, stdin);
         if (nread <= 0) {
             printf("\n");
+            fat_save_image(fs_image_path);
             save_history();  // Save history on EOF
             break;
         }
@@ -1521,6 +5732,9 @@ int main() {
         parse_pipeline(line_copy, cmds, &num_cmds);
         execute_pipeline(cmds, num_cmds);
         
+        // One journal transaction per command line
+        fat_commit();
+        
         // Free strdup'd strings from parsing
         for (int i = 0; i < num_cmds; i++) {
             for (int j = 0; j < cmds[i].argc; j++) {
@@ -1540,6 +5754,7 @@ int main() {
         free(command_history[i]);
     }
     
+    fat_detach_image();
     free(fs);
     return 0;
 }
\ No newline at end of file
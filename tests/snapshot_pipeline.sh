@@ -0,0 +1,38 @@
+#!/bin/sh
+# Regression test: "snapshot x | cat" used to run the snapshot in the forked
+# pipeline child, leaving a snapshot file whose blocks the shell itself kept
+# reusing. A state-changing builtin in a pipeline must be refused instead.
+# Usage: tests/snapshot_pipeline.sh [path/to/mysh]
+
+MYSH=$(cd "$(dirname "${1:-./mysh}")" && pwd)/$(basename "${1:-./mysh}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR/OS_PROJECT"
+
+OUT=$(cd "$DIR" && "$MYSH" 2>&1 <<'EOF'
+seq 1 2000 > f
+snapshot x | cat
+snapshots
+snapshot x
+rm f
+seq 70000 72000 > g
+seq 80000 82000 > h
+rollback x
+head -n 1 f
+fsck
+exit
+EOF
+)
+
+fail() {
+    echo "FAIL: $1"
+    echo "$OUT"
+    exit 1
+}
+
+echo "$OUT" | grep -q 'snapshot: cannot be used in a pipeline' || fail "snapshot ran inside the pipeline"
+echo "$OUT" | grep -q 'No snapshots' || fail "the pipeline left a snapshot behind"
+[ ! -e "$DIR/OS_PROJECT/mysh_fs.img.snap.x.new" ] || fail "a half-written snapshot was left behind"
+echo "$OUT" | grep -q '^\$ 1$' || fail "rollback did not restore f"
+echo "$OUT" | grep -q 'checked with .*: clean' || fail "fsck found problems"
+echo "PASS"